@@ -0,0 +1,182 @@
+/* Parser throughput for smallsh, built by "make bench" with smallsh.c included and its main renamed */
+/* Times createCommand on a fresh copy of each line against the strtok_r parser it replaced, and parseProgram plus binding */
+/* on the same lines repeated so they come from the cache */
+#include "../smallsh.c"
+
+#undef main
+
+/* Lines parsed by the benchmark, a mix of plain words, expansions, redirections and pipelines (nothing is run) */
+const char* benchLines[] = {
+    "ls -la /usr/bin /usr/lib /usr/share /etc",
+    "grep -n pattern file1 file2 file3 > out.txt",
+    "sort < input.txt | uniq -c | sort -rn | head -n 20",
+    "echo $HOME ${USER} pid $$ status $? last $!",
+    "cc -O2 -Wall -o prog main.c util.c parse.c io.c &",
+    "X=value Y=${X}suffix",
+    "printf %s-%d\\n alpha 1 beta 2 gamma 3 delta 4 epsilon 5",
+    "test -f /etc/passwd",
+};
+#define BENCH_LINES (int)(sizeof(benchLines) / sizeof(benchLines[0]))
+
+/* The strtok_r parser createCommand replaced, kept as it was so the lexer can be compared against it on the same lines */
+/* Receives a poitner to a string and replaces any instances of '$$' with the smallsh process id (done in place) */
+void legacyReplaceSubstring(char *target, const char *needle, const char *replacement)
+{
+    char buffer[1024] = { 0 };
+    char *insert_point = &buffer[0];
+    const char *tmp = target;
+    size_t needle_len = strlen(needle);
+    size_t repl_len = strlen(replacement);
+
+    while (1) {
+        const char *p = strstr(tmp, needle);
+
+        if (p == NULL) {
+            strcpy(insert_point, tmp);
+            break;
+        }
+
+        memcpy(insert_point, tmp, p - tmp);
+        insert_point += p - tmp;
+        memcpy(insert_point, replacement, repl_len);
+        insert_point += repl_len;
+
+        tmp = p + needle_len;
+    }
+    strcpy(target, buffer);
+}
+
+/* Parse the command given by user into the command struct, returns pointer to that struct or NULL if the line has no command */
+struct userCommand *legacyCreateCommand(char *userInput)
+{
+    userInput[strcspn(userInput, "\n")] = '\0'; // Remove newline character from userInput
+    struct userCommand *currCommand = arenaAlloc(&commandArena, sizeof(struct userCommand));
+    memset(currCommand, 0, sizeof(struct userCommand));
+
+    currCommand->toBackground = 0; // Set toBackground value to False as default behavior
+
+    char expansionBuffer[10]; // For use with strreplace function
+    snprintf(expansionBuffer, 10, "%d", pid);
+    char tmp_token[200]; // To store value in token and copy it over after varaible expansion
+
+    // Count the words in the line, an upper bound on the number of arguments, to size the scratch array of words
+    int maxWords = 0;
+    char *scan = userInput;
+    while (*scan != '\0'){
+        while (*scan == ' ') scan++;
+        if (*scan == '\0') break;
+        maxWords++;
+        while (*scan != ' ' && *scan != '\0') scan++;
+    }
+    if (maxWords == 0){
+        return NULL;
+    }
+    char **words = arenaAlloc(&commandArena, maxWords * sizeof(char*));
+    int word_count = 0;
+
+    // For use with strtok_r
+    char *saveptr;
+    char *token = strtok_r(userInput, " ", &saveptr);
+
+    // Get command and arguments data, replacing $$ with the PID, and put redirections into struct attributes
+    while (token != NULL) {
+        if (word_count > 0 && (token[0] == '<' || token[0] == '>')){ // Check for input/output redirects
+            char *redirect = token;
+            token = strtok_r(NULL, " ", &saveptr);
+            if (token == NULL){
+                break;
+            }
+            if (redirect[0] == '<'){ // Input redirection- get filename for input and put it into struct attribute
+                currCommand->inputFile = arenaStrndup(&commandArena, token, strlen(token));
+            }
+            else { // Output redirection- get filename for output and put it into struct attribute
+                currCommand->outputFile = arenaStrndup(&commandArena, token, strlen(token));
+            }
+        }
+        else if (word_count > 0 && token[0] == '&'){
+            // Check to make sure there are no more arguments given by calling for next token
+            token = strtok_r(NULL, " ", &saveptr);
+            if (token == NULL){ // If there are no more arguments given then this means last argument so command is to be executed in background
+                currCommand->toBackground = 1;
+                break;
+            }
+            continue;
+        }
+        else {
+            snprintf(tmp_token, sizeof(tmp_token), "%s", token);
+            legacyReplaceSubstring(tmp_token, "$$", expansionBuffer); // Replace $$ with PID
+            words[word_count++] = arenaStrndup(&commandArena, tmp_token, strlen(tmp_token));
+        }
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    // Copy the words into an argv sized for exactly the arguments given
+    currCommand->argv = arenaAlloc(&commandArena, (word_count + 1) * sizeof(char*));
+    memcpy(currCommand->argv, words, word_count * sizeof(char*));
+    currCommand->argv[word_count] = NULL;
+    currCommand->command = currCommand->argv[0];
+    currCommand->argument = currCommand->argv + 1;
+    currCommand->argumentCount = word_count - 1;
+    return currCommand;
+}
+
+double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]){
+    long rounds = (argc > 1) ? atol(argv[1]) : 200000;
+    pid = getpid();
+    pidLength = snprintf(pidString, sizeof(pidString), "%d", pid);
+    importEnvironment();
+
+    // Tokens per line, counted once from a template
+    long tokensPerRound = 0;
+    int i;
+    for (i = 0; i < BENCH_LINES; i++){
+        char* copy = arenaStrndup(&commandArena, benchLines[i], strlen(benchLines[i]));
+        tokensPerRound += buildTemplate(&commandArena, copy)->count - 1;
+    }
+    arenaReset(&commandArena);
+
+    char line[256];
+    long round;
+    double start = now();
+    for (round = 0; round < rounds; round++){
+        for (i = 0; i < BENCH_LINES; i++){
+            strcpy(line, benchLines[i]);
+            createCommand(line);
+            arenaReset(&commandArena);
+        }
+    }
+    double parseSeconds = now() - start;
+
+    start = now();
+    for (round = 0; round < rounds; round++){
+        for (i = 0; i < BENCH_LINES; i++){
+            strcpy(line, benchLines[i]);
+            legacyCreateCommand(line);
+            arenaReset(&commandArena);
+        }
+    }
+    double legacySeconds = now() - start;
+
+    start = now();
+    for (round = 0; round < rounds; round++){
+        for (i = 0; i < BENCH_LINES; i++){
+            int incomplete;
+            bindTemplate(&parseProgram(benchLines[i], &incomplete)->words);
+            arenaReset(&commandArena);
+        }
+    }
+    double cachedSeconds = now() - start;
+
+    long lines = rounds * BENCH_LINES;
+    printf("{\"lines\": %ld, \"lines_per_sec\": %.0f, \"tokens_per_sec\": %.0f, \"legacy_lines_per_sec\": %.0f, "
+           "\"legacy_tokens_per_sec\": %.0f, \"cached_lines_per_sec\": %.0f}\n",
+           lines, lines / parseSeconds, rounds * tokensPerRound / parseSeconds, lines / legacySeconds,
+           rounds * tokensPerRound / legacySeconds, lines / cachedSeconds);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Benchmarks and stress test for smallsh, prints one JSON object with the results
+# usage: bench/run.sh [SHELL] [PARSER_BENCH]
+#   BENCH_COUNT  commands per launch benchmark (default 2000)
+#   STRESS_JOBS  concurrent background jobs in the stress test (default 2000)
+
+SHELL_BIN=${1:-./smallsh}
+PARSER_BENCH=${2:-bench/parser_bench}
+COUNT=${BENCH_COUNT:-2000}
+JOBS=${STRESS_JOBS:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# Runs a script through the shell and prints the wall time in nanoseconds
+timeScript() {
+    start=$(now)
+    "$SHELL_BIN" "$1" > "$WORK/out.txt" 2>&1
+    end=$(now)
+    echo $((end - start))
+}
+
+# Prints commands per second for COUNT lines of the given command
+rate() {
+    i=0
+    : > "$WORK/rate.sh"
+    while [ $i -lt "$COUNT" ]; do
+        echo "$1" >> "$WORK/rate.sh"
+        i=$((i + 1))
+    done
+    elapsed=$(timeScript "$WORK/rate.sh")
+    echo "$COUNT $elapsed" | awk '{ printf "%.0f", $1 / ($2 / 1e9) }'
+}
+
+builtinRate=$(rate "true")
+externalRate=$(rate "/bin/true")
+
+# Launch to reap latency of each external command, from the wall time acct logs for every job
+{
+    echo "acct on $WORK/acct.csv"
+    i=0
+    while [ $i -lt "$COUNT" ]; do
+        echo "/bin/true"
+        i=$((i + 1))
+    done
+} > "$WORK/latency.sh"
+"$SHELL_BIN" "$WORK/latency.sh" > /dev/null 2>&1
+latency=$(tail -n +2 "$WORK/acct.csv" | cut -d, -f4 | sort -n | awk '
+    { wall[NR] = $1 }
+    END {
+        p50 = wall[int(NR * 0.50 + 0.5)]; p99 = wall[int(NR * 0.99 + 0.5)]
+        printf "{\"samples\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f}", NR, p50 * 1e6, p99 * 1e6
+    }')
+
+parser=$("$PARSER_BENCH")
+
+# Stress test, JOBS background sleeps running at once, every one has to be reported done and reaped
+{
+    echo "parallel -j 0"
+    i=0
+    while [ $i -lt "$JOBS" ]; do
+        echo "sleep 1 &"
+        i=$((i + 1))
+    done
+    echo "wait"
+} > "$WORK/stress.sh"
+elapsed=$(timeScript "$WORK/stress.sh")
+launched=$(grep -c "^background pid is" "$WORK/out.txt")
+reaped=$(grep -c "is done: exit value 0" "$WORK/out.txt")
+stress=$(echo "$JOBS $launched $reaped $elapsed" | awk '{ printf "{\"jobs\": %d, \"launched\": %d, \"reaped\": %d, \"seconds\": %.3f}", $1, $2, $3, $4 / 1e9 }')
+
+printf '{"builtin_per_sec": %s, "external_per_sec": %s, "latency": %s, "parser": %s, "stress": %s}\n' \
+    "$builtinRate" "$externalRate" "$latency" "$parser" "$stress"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For pipe2 and F_SETPIPE_SZ
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,496 +10,4372 @@
 #include <fcntl.h> 
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 
 pid_t pid; // Global variable to store process ID of smallsh itself
+char pidString[16]; // Process ID of smallsh as text, what $$ expands to
+size_t pidLength; // Length of pidString
 int statusExit; // Global variable to store last exit status, returned when user uses built in status command
 int statusSignal; // Global variable to store last signal, returned when user uses built in status command
 int exitTrue; // Boolean to say that we are looking at exit value as the variable returned by built in status
 int foregroundOnlyMode; // Boolean to indicate whether the shell is in foreground only mode
-int numberOfProcesses; // Keeps track of the number of processes - 0 indexed
-pid_t processes[100]; // Array to store pids of running processes
+int interactive; // Boolean, set when reading commands from a terminal, the prompt is only shown in interactive mode
+int pipeBufferSize; // Capacity requested for pipeline pipes with F_SETPIPE_SZ, 0 leaves the kernel default
+int eventFD; // epoll set the shell waits on: input, signalFD and a pidfd per background process
+int inputFD; // fd commands are read from, in the epoll set when inputPollable
+int signalFD; // signalfd for SIGCHLD, SIGTSTP and SIGINT, which are blocked in the shell and handled from the event loop
+int inputPollable; // Boolean, input can be waited on with epoll (terminals and pipes, not regular files)
+int pidfdSupported; // Boolean, the kernel has pidfd_open, otherwise SIGCHLD is what tells us a job terminated
+int atPrompt; // Boolean, set while waiting for the user to type a line
+int promptInterrupted; // Boolean, something was printed while at the prompt so it needs to be shown again
+const char* prompt = ": "; // Prompt being shown, "> " while the rest of a block is read
+int interrupted; // Boolean, ^C was pressed since the program being run started, loops stop at the end of an iteration
+int loopDepth; // Number of loops the command being run is inside of
+int bindFailed; // Boolean, the last bindTemplate returned NULL for a syntax error rather than an empty command
+int loopControl; // LOOP_BREAK or LOOP_CONTINUE after one of those built ins, LOOP_INTERRUPT after ^C, 0 otherwise
 
-/* Struct for command information */
+#define LOOP_BREAK 1
+#define LOOP_CONTINUE 2
+#define LOOP_INTERRUPT 3
+
+/* Kinds of events in the epoll set, stored in the top half of the event data with a pid in the bottom half */
+#define EVENT_INPUT 1
+#define EVENT_SIGNAL 2
+#define EVENT_JOB 3
+extern char **environ; // Environment the shell started with, copied into the variable table
+
+/* Struct for command information, lives in the command arena along with everything it points to */
 struct userCommand
 {
     int toBackground; // Used to determine if command is supposed to be run in background
     char* inputFile;
     char* outputFile;
-    char* argument[512]; // maximum number of arguments is 512 of undetermined length
-    char* command; // flexible w/ no character limit
+    int argumentCount; // number of arguments after the command
+    char** argv; // NULL terminated command followed by its arguments, sized to the arguments given
+    char** argument; // arguments only (argv + 1)
+    char* command; // flexible w/ no character limit (argv[0])
+    struct userCommand* nextStage; // command the output is piped into, NULL for the last stage of a pipeline
+    int timed; // Boolean, set when the line starts with the time prefix, only used on the first stage
+};
+
+/* Struct for the resources used by a job, from wait4's rusage plus the wall clock time between launch and reaping */
+struct jobStats
+{
+    double wallSeconds;
+    double userSeconds;
+    double systemSeconds;
+    long maxRSS; // largest resident set size of any stage, in kilobytes
+    long voluntarySwitches;
+    long involuntarySwitches;
+};
+
+/* Struct for a block of memory handed out by an arena */
+struct arenaBlock
+{
+    struct arenaBlock* next; // previously filled block
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(16))); // malloc'd blocks are 16 byte aligned, so allocations from data are too
+};
+
+/* Struct for a bump allocator that is reset in one step, parsed commands are allocated from one of these per line */
+struct arena
+{
+    struct arenaBlock* head; // block currently being allocated from
+};
+
+/* Token types produced by the lexer */
+enum tokenType { TOKEN_WORD, TOKEN_INPUT, TOKEN_OUTPUT, TOKEN_PIPE, TOKEN_BACKGROUND, TOKEN_SEPARATOR, TOKEN_NEWLINE, TOKEN_AND, TOKEN_OR, TOKEN_END };
+
+/* Struct for the lexer's position in a line of input */
+struct lexer
+{
+    char* cursor; // next character to scan
+    char pending; // operator character that was overwritten to terminate the word before it, 0 if none
+};
+
+/* Kinds of pieces a word with expansions is made of */
+enum segmentKind { SEGMENT_LITERAL, SEGMENT_EXPANSION, SEGMENT_SUBSTITUTION };
+
+/* Struct for a piece of a word with expansions in it, the word is put back together each time its template is bound */
+struct wordSegment
+{
+    int kind;
+    const char* text; // literal text, the $ expansion as written or the command inside $(...)
+    size_t length;
+    struct wordSegment* next;
+};
+
+/* Struct for a token of a line, a word without expansions is used as it is every time the line runs */
+struct templateToken
+{
+    int type; // token type from the lexer
+    char* text; // the word, NULL when it is bound from segments
+    struct wordSegment* segments;
+};
+
+/* Struct for a line tokenized once and bound into a userCommand each time it is run, expansions are done when binding */
+struct commandTemplate
+{
+    struct templateToken* tokens; // ends with a TOKEN_END token, or after count tokens for a command within a line
+    int count;
+};
+
+/* Kinds of nodes in a parsed program */
+enum nodeType { NODE_COMMAND, NODE_AND, NODE_OR, NODE_IF, NODE_WHILE, NODE_FOR };
+
+/* Struct for a node of a parsed program, blocks are parsed into these once and run as many times as they loop without */
+/* being tokenized again, the nodes of a list run one after another are linked through next */
+struct commandNode
+{
+    int type;
+    int negate; // Boolean, a leading ! inverts the exit status
+    int until; // Boolean, an until loop, which runs while its condition fails
+    struct commandTemplate words; // tokens of a command (or pipeline), or the words a for loop goes through
+    char* variable; // name a for loop assigns each word to
+    struct commandNode* condition; // list deciding if and while, the left side of && and ||
+    struct commandNode* body; // list run by if, while and for, the right side of && and ||
+    struct commandNode* otherwise; // else branch of an if, an elif is an if node of its own
+    struct commandNode* next;
+};
+
+/* Struct for the parser's position in the tokens of a program */
+struct parser
+{
+    struct arena* pool; // nodes are allocated from here
+    struct templateToken* tokens;
+    int position;
+    int incomplete; // Boolean, the tokens ran out inside a block or after && or ||, so more lines are needed
+    int failed; // Boolean, a syntax error was reported
+};
+
+/* Struct for a position in an arena, everything allocated after it can be released while keeping what came before */
+struct arenaMark
+{
+    struct arenaBlock* block;
+    size_t used;
+};
+
+/* Struct for a program in the parsed command cache, entries are kept in least recently used order */
+struct cachedLine
+{
+    char* line; // program as it was read, lines of a block are joined by newlines
+    struct arena pool; // holds line, the template, the nodes and the copy of the line they were parsed from
+    struct commandNode* program;
+    struct cachedLine* next; // next line in the same bucket
+    struct cachedLine* newer; // neighbours in the recently used list
+    struct cachedLine* older;
+};
+
+#define PARSE_CACHE_BUCKETS 256
+#define PARSE_CACHE_LIMIT 128
+struct cachedLine* parseCache[PARSE_CACHE_BUCKETS]; // Hash table from a program to its parsed nodes
+struct cachedLine* newestLine; // Most recently used line, evictions come from the other end
+struct cachedLine* oldestLine;
+int parseCacheCount;
+long parseCacheHits;
+long parseCacheMisses;
+
+#define HISTORY_MAX_BYTES (8 << 20) // History file is rotated once it would grow past this
+char* historyPath; // File history is kept in, only used in interactive mode
+int historyFD = -1;
+char* historyMap; // The history file mapped read only, remapped when its size changes
+size_t historyMapSize;
+size_t* historyIndex; // Offset of each entry in historyMap, built the first time history is used
+int historyCount;
+int historyCapacity;
+size_t historyIndexed; // Bytes of historyMap already indexed
+
+/* Struct for reading lines of input through a large buffer, lines can be of any length */
+struct inputReader
+{
+    int fd; // file the commands are read from
+    char* buffer;
+    size_t capacity; // size of buffer, grows to hold the longest line seen
+    size_t start; // first byte not yet returned as part of a line
+    size_t end; // one past the last byte read into buffer
+    size_t scanned; // bytes from start already searched for a newline
+    int atEOF; // Boolean, set once read has returned end of file
+};
+
+#define INPUT_BUFFER_SIZE 65536
+#define ARENA_BLOCK_SIZE 8192
+struct arena commandArena; // Arena for the command currently being parsed and run, reset after every line
+
+/* Struct for a background process in the job table, a pipeline has one entry per stage sharing a job number */
+struct job
+{
+    pid_t pid; // 0 when the slot is free
+    pid_t processGroup; // process group shared by every stage of the job
+    int jobNumber; // number shown by jobs and used by kill %n
+    char* commandLine; // command as the user gave it, only set for the stage reported when the job is done
+    int timed; // Boolean, report the job's resource use when it is done (time prefix)
+    int pidfd; // pidfd in the epoll set that becomes readable when the process terminates, -1 if there is none
+    struct timespec started; // when the job was launched, for its wall clock time
+    int next; // next slot in the same pid bucket, or the next free slot, -1 ends either list
+};
+
+struct job* jobTable; // Growable array of job slots
+int* jobBuckets; // Hash of pid to first slot in that bucket, one bucket per slot
+int jobCapacity; // Number of slots in jobTable (always a power of 2)
+int freeJobSlot; // Head of the list of unused slots
+int numberOfJobs; // Number of background jobs still running
+int lastJobNumber; // Highest job number handed out, numbering restarts once the table is empty
+int activeJobs; // Number of background jobs (not stages) whose last stage hasn't been reaped yet
+int unwatchedJobs; // Number of job table entries without a pidfd in the epoll set, SIGCHLD reaps those
+struct jobStats lastJobStats; // Resources used by the last job reaped, shown by status when accounting is on
+int accountingOn; // Boolean, set by acct on, every job's resource use is reported or logged
+FILE* accountingLog; // CSV file job resource use is appended to by acct on FILE, NULL to report on stderr instead
+int maxParallelJobs; // Cap on activeJobs set with parallel -j, further background commands wait in a queue, 0 for no cap
+
+/* Struct for a resource limit set with jobopt -l */
+struct jobLimit
+{
+    int resource; // RLIMIT_* value
+    rlim_t value; // used as both the soft and hard limit
+};
+
+/* Names jobopt -l takes for resource limits */
+const struct { const char* name; int resource; } limitNames[] = {
+    {"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU}, {"data", RLIMIT_DATA}, {"fsize", RLIMIT_FSIZE},
+    {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC}, {"rss", RLIMIT_RSS}, {"stack", RLIMIT_STACK},
+};
+#define LIMIT_NAMES (int)(sizeof(limitNames) / sizeof(limitNames[0]))
+
+int jobOptionsSet; // Boolean, background commands are launched through launchWithOptions to apply the options below
+cpu_set_t jobCPUs; // CPUs background processes may run on, with jobCPUCount 0 they can run anywhere
+int jobCPUCount;
+int jobCPURoundRobin; // Boolean, each background process is pinned to the next CPU of jobCPUs (or the shell's CPUs) in turn
+int nextJobCPU; // CPU the round robin looks from next
+int jobNiceSet; // Boolean, background processes get the nice value jobNice
+int jobNice;
+struct jobLimit jobLimits[LIMIT_NAMES]; // Resource limits for background processes
+int jobLimitCount;
+
+/* Struct for a background command waiting for a free slot under the parallel -j cap */
+struct queuedJob
+{
+    struct arena pool; // holds the copy of the command, it outlives the line it was parsed from
+    struct userCommand* command;
+    struct queuedJob* next;
+};
+
+struct queuedJob* jobQueueHead; // Next background command to start
+struct queuedJob* jobQueueTail; // Last background command queued
+int queuedJobCount;
+
+/* Struct for an entry in the hashed command table, remembers where a command was found on PATH (like bash's hash) */
+struct hashedCommand
+{
+    char* name;
+    char* path; // absolute path the command resolved to
+    int hits; // number of times the entry has been used
+    struct hashedCommand* next; // next entry in the same bucket
+};
+
+#define COMMAND_HASH_BUCKETS 64
+struct hashedCommand* commandHash[COMMAND_HASH_BUCKETS]; // Hash table from command name to resolved path
+char* hashedPATH; // Value of PATH the hash table was filled against, table is emptied when PATH changes
+
+/* Struct for a shell variable, kept as NAME=value so exported variables can go into the environment as they are */
+struct shellVariable
+{
+    char* entry; // NAME=value
+    size_t nameLength; // the value starts at entry + nameLength + 1
+    int exported; // Boolean, the variable is passed to commands in their environment
+    struct shellVariable* next; // next variable in the same bucket
+};
+
+#define VARIABLE_BUCKETS 256
+struct shellVariable* variableTable[VARIABLE_BUCKETS]; // Hash table of shell variables, starts out holding the environment
+char** environment; // Exported variables in the form posix_spawn takes, only rebuilt when a child is about to be spawned
+int environmentDirty = 1; // Boolean, an exported variable changed since environment was built (starts set so an empty environment is still built)
+int exportedCount; // Number of exported variables
+pid_t lastBackgroundPid; // What $! expands to, 0 before any background job has been launched
+int captureFD = -1; // memfd the output of built ins run in a $(...) substitution is captured in, created when first needed
+
+/* Struct for a directory listing cached for globbing, reused for as long as the directory's mtime doesn't change */
+struct dirListing
+{
+    char* path; // directory as named in the pattern, "." for the current directory
+    dev_t device; // identity of the directory when it was read, so a cd or a replaced directory is noticed
+    ino_t inode;
+    struct timespec modified; // mtime of the directory when it was read
+    time_t readAt; // when it was read, changes within the mtime's granularity of the read can't be told apart
+    char** names; // entries other than . and .. sorted with strcmp
+    int count;
+    char* nameData; // block all the names are stored in
+    unsigned long lastUsed; // value of dirCacheClock when the listing was last used, the oldest is evicted
+    int pinned; // number of globMatch calls walking names, the listing isn't evicted while any are
+    struct dirListing* next; // next listing in the same bucket
+};
+
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_LIMIT 256
+#define DIR_RACY_SECONDS 2 // a listing read this close to the directory's mtime is read again, timestamps can be coarse
+struct dirListing* dirCache[DIR_CACHE_BUCKETS]; // Hash table from directory path to its listing
+int dirCacheCount;
+unsigned long dirCacheClock;
+
+/* Struct for a growable array of words, the arguments of a command are collected in one while it is parsed */
+struct wordList
+{
+    char** words;
+    int count;
+    int capacity;
 };
 
-/* Struct for background process information */
-struct bgProcessInfo
-{
-    pid_t childID;
-    int childExitMethod;
-};
+/* Initialize empty structs for signal handling */
+struct sigaction ignore_action = {0};
+
+/* Starts a line of output that interrupts the prompt, moving off the prompt's line first */
+void beginNotice(){
+    if (atPrompt && interactive && !promptInterrupted){
+        printf("\n");
+        promptInterrupted = 1;
+    }
+}
+
+/* Prints the message for a change in foreground only mode, SIGTSTP is only read from signalFD between commands so this */
+/* shows up after any running foreground process has terminated */
+void reportModeChange(){
+    beginNotice();
+    if (foregroundOnlyMode == 1){
+        printf("Entering foreground-only mode (& is now ignored)\n");
+    }
+    else {
+        printf("Exiting foreground-only mode\n");
+    }
+    fflush(stdout);
+}
+
+/* Returns memory for size bytes from the arena, adding a block when the current one is full */
+void* arenaAlloc(struct arena* pool, size_t size){
+    size = (size + 15) & ~(size_t)15; // Keep every allocation 16 byte aligned
+    struct arenaBlock* block = pool->head;
+    if (block == NULL || block->size - block->used < size){
+        size_t blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arenaBlock) + blockSize);
+        block->size = blockSize;
+        block->used = 0;
+        block->next = pool->head;
+        pool->head = block;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+/* Frees every block of an arena, for arenas that aren't reused */
+void arenaFree(struct arena* pool){
+    struct arenaBlock* block = pool->head;
+    while (block != NULL){
+        struct arenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    pool->head = NULL;
+}
+
+/* Copies length bytes of a string into the arena and NULL terminates the copy */
+char* arenaStrndup(struct arena* pool, const char* string, size_t length){
+    char* copy = arenaAlloc(pool, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* Returns the arena's current position, to release back to with arenaRelease */
+struct arenaMark arenaPosition(struct arena* pool){
+    struct arenaMark mark = { pool->head, (pool->head == NULL) ? 0 : pool->head->used };
+    return mark;
+}
+
+/* Releases everything allocated from the arena since mark, freeing any blocks added after it */
+/* A mark taken while the arena was empty keeps its first block to be reused, as arenaReset would */
+void arenaRelease(struct arena* pool, struct arenaMark mark){
+    while (pool->head != mark.block && !(mark.block == NULL && pool->head->next == NULL)){
+        struct arenaBlock* next = pool->head->next;
+        free(pool->head);
+        pool->head = next;
+    }
+    if (pool->head != NULL){
+        pool->head->used = mark.used;
+    }
+}
+
+/* Releases everything allocated from the arena at once, if the last line needed several blocks they are replaced */
+/* by a single block big enough for all of them so the arena settles at one block */
+void arenaReset(struct arena* pool){
+    struct arenaBlock* block = pool->head;
+    if (block == NULL){
+        return;
+    }
+    if (block->next != NULL){
+        size_t total = 0;
+        while (block != NULL){
+            struct arenaBlock* next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
+        }
+        block = malloc(sizeof(struct arenaBlock) + total);
+        block->size = total;
+        block->next = NULL;
+        pool->head = block;
+    }
+    block->used = 0;
+}
+
+/* Returns the next complete line already read without its newline, or NULL if more input is needed or it has run out */
+/* The line is NULL terminated in the reader's buffer and stays valid until the next call, it may be modified in place */
+char* takeLine(struct inputReader* reader){
+    char* newline = memchr(reader->buffer + reader->start + reader->scanned, '\n', reader->end - reader->start - reader->scanned);
+    if (newline != NULL){
+        char* line = reader->buffer + reader->start;
+        *newline = '\0';
+        reader->start = newline + 1 - reader->buffer;
+        reader->scanned = 0;
+        return line;
+    }
+    reader->scanned = reader->end - reader->start;
+
+    // Last line of a file may not end in a newline
+    if (reader->atEOF && reader->start != reader->end){
+        char* line = reader->buffer + reader->start;
+        reader->buffer[reader->end] = '\0';
+        reader->start = reader->end;
+        reader->scanned = 0;
+        return line;
+    }
+    return NULL;
+}
+
+/* Reads whatever input is available into the reader's buffer with a single read, sets atEOF when input runs out */
+void fillReader(struct inputReader* reader){
+    // Make room for more input, moving the partial line to the front and growing the buffer if it is full of one line
+    if (reader->start > 0){
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end + 1 == reader->capacity){
+        reader->capacity *= 2;
+        reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+
+    // One byte is always kept free for the terminator of a last line without a newline
+    ssize_t bytesRead = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+    if (bytesRead == -1 && (errno == EINTR || errno == EAGAIN)){
+        return;
+    }
+    if (bytesRead <= 0){
+        reader->atEOF = 1;
+    }
+    else {
+        reader->end += bytesRead;
+    }
+}
+
+/* Returns the status of the last foreground command as a shell exit code, a signal number n is reported as 128 + n */
+int lastStatus(){
+    return exitTrue ? statusExit : 128 + statusSignal;
+}
+
+/* Returns the FNV-1a hash of a string, used for the shell's hash tables */
+unsigned int hashString(const char* string){
+    unsigned int hash = 2166136261u;
+    while (*string != '\0'){
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the FNV-1a hash of length bytes, for names that aren't NULL terminated */
+unsigned int hashBytes(const char* bytes, size_t length){
+    unsigned int hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++){
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the variable with the given name (length bytes, not necessarily NULL terminated), or NULL if it isn't set */
+struct shellVariable* findVariable(const char* name, size_t length){
+    struct shellVariable* variable;
+    for (variable = variableTable[hashBytes(name, length) % VARIABLE_BUCKETS]; variable != NULL; variable = variable->next){
+        if (variable->nameLength == length && memcmp(variable->entry, name, length) == 0){
+            return variable;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the value of a variable, or NULL if it isn't set */
+const char* getVariable(const char* name){
+    size_t length = strlen(name);
+    struct shellVariable* variable = findVariable(name, length);
+    return (variable == NULL) ? NULL : variable->entry + length + 1;
+}
+
+/* Sets a variable, creating it if needed, the environment is only marked to be rebuilt when the variable is exported */
+struct shellVariable* setVariable(const char* name, size_t nameLength, const char* value, size_t valueLength){
+    struct shellVariable* variable = findVariable(name, nameLength);
+    if (variable == NULL){
+        unsigned int bucket = hashBytes(name, nameLength) % VARIABLE_BUCKETS;
+        variable = malloc(sizeof(struct shellVariable));
+        variable->entry = NULL;
+        variable->nameLength = nameLength;
+        variable->exported = 0;
+        variable->next = variableTable[bucket];
+        variableTable[bucket] = variable;
+    }
+    variable->entry = realloc(variable->entry, nameLength + valueLength + 2);
+    memmove(variable->entry, name, nameLength);
+    variable->entry[nameLength] = '=';
+    memcpy(variable->entry + nameLength + 1, value, valueLength);
+    variable->entry[nameLength + 1 + valueLength] = '\0';
+    if (variable->exported){
+        environmentDirty = 1;
+    }
+    return variable;
+}
+
+/* Marks a variable to be passed to commands */
+void exportVariable(struct shellVariable* variable){
+    if (!variable->exported){
+        variable->exported = 1;
+        exportedCount++;
+        environmentDirty = 1;
+    }
+}
+
+/* Removes a variable */
+void unsetVariable(const char* name){
+    size_t length = strlen(name);
+    struct shellVariable** link = &variableTable[hashBytes(name, length) % VARIABLE_BUCKETS];
+    while (*link != NULL){
+        if ((*link)->nameLength == length && memcmp((*link)->entry, name, length) == 0){
+            struct shellVariable* variable = *link;
+            *link = variable->next;
+            if (variable->exported){
+                exportedCount--;
+                environmentDirty = 1;
+            }
+            free(variable->entry);
+            free(variable);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Loads the environment the shell was started with into the variable table, every variable in it is exported */
+void importEnvironment(){
+    char** entry;
+    for (entry = environ; *entry != NULL; entry++){
+        char* equals = strchr(*entry, '=');
+        if (equals != NULL){
+            exportVariable(setVariable(*entry, equals - *entry, equals + 1, strlen(equals + 1)));
+        }
+    }
+}
+
+/* Returns the environment for a command being spawned, rebuilt from the exported variables only if one has changed */
+/* The entries point at the variables' own NAME=value strings, so only the array is built */
+char** shellEnvironment(){
+    if (environmentDirty){
+        environment = realloc(environment, (exportedCount + 1) * sizeof(char*));
+        int count = 0;
+        int i;
+        struct shellVariable* variable;
+        for (i = 0; i < VARIABLE_BUCKETS; i++){
+            for (variable = variableTable[i]; variable != NULL; variable = variable->next){
+                if (variable->exported){
+                    environment[count++] = variable->entry;
+                }
+            }
+        }
+        environment[count] = NULL;
+        environmentDirty = 0;
+    }
+    return environment;
+}
+
+/* Returns the length of the variable name at the start of text, 0 if it doesn't start with one */
+size_t variableNameLength(const char* text){
+    size_t length = 0;
+    if ((text[0] >= 'a' && text[0] <= 'z') || (text[0] >= 'A' && text[0] <= 'Z') || text[0] == '_'){
+        for (length = 1; (text[length] >= 'a' && text[length] <= 'z') || (text[length] >= 'A' && text[length] <= 'Z') ||
+                         (text[length] >= '0' && text[length] <= '9') || text[length] == '_'; length++){}
+    }
+    return length;
+}
+
+/* Returns 1 if a word is a NAME=value assignment */
+int isAssignment(const char* word){
+    size_t nameLength = variableNameLength(word);
+    return nameLength != 0 && word[nameLength] == '=';
+}
+
+/* Empties the hashed command table */
+void clearCommandHash(){
+    int i;
+    for (i = 0; i < COMMAND_HASH_BUCKETS; i++){
+        struct hashedCommand* entry = commandHash[i];
+        while (entry != NULL){
+            struct hashedCommand* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        commandHash[i] = NULL;
+    }
+}
+
+/* Searches each directory on PATH for an executable with the given name, returns a newly allocated path or NULL if not found */
+char* searchPATH(const char* name){
+    const char* path = getVariable("PATH");
+    if (path == NULL){
+        path = "/bin:/usr/bin";
+    }
+    size_t nameLength = strlen(name);
+    char candidate[PATH_MAX];
+    struct stat info;
+
+    // Walk the colon separated list, an empty entry means the current directory
+    while (1){
+        const char* end = strchr(path, ':');
+        size_t dirLength = (end == NULL) ? strlen(path) : (size_t)(end - path);
+        if (dirLength == 0){
+            candidate[0] = '.';
+            dirLength = 1;
+        }
+        else if (dirLength < PATH_MAX){
+            memcpy(candidate, path, dirLength);
+        }
+        if (dirLength + nameLength + 2 <= PATH_MAX){
+            candidate[dirLength] = '/';
+            memcpy(candidate + dirLength + 1, name, nameLength + 1);
+            if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0){
+                return strdup(candidate);
+            }
+        }
+        if (end == NULL){
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+/* Drops a command from the hashed command table, used when the cached path no longer exists */
+void forgetCommand(const char* name){
+    struct hashedCommand** link = &commandHash[hashString(name) % COMMAND_HASH_BUCKETS];
+    while (*link != NULL){
+        if (strcmp((*link)->name, name) == 0){
+            struct hashedCommand* entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Returns the path a command should be executed from, searching PATH only the first time a name is seen */
+/* Names containing a slash are used as given, returns NULL if the command can't be found */
+const char* lookupCommand(const char* name, int countHit){
+    if (strchr(name, '/') != NULL){
+        return name;
+    }
+
+    // Throw the whole table away if PATH changed since it was filled
+    const char* path = getVariable("PATH");
+    if (path == NULL) path = "";
+    if (hashedPATH == NULL || strcmp(hashedPATH, path) != 0){
+        clearCommandHash();
+        free(hashedPATH);
+        hashedPATH = strdup(path);
+    }
+
+    unsigned int bucket = hashString(name) % COMMAND_HASH_BUCKETS;
+    struct hashedCommand* entry;
+    for (entry = commandHash[bucket]; entry != NULL; entry = entry->next){
+        if (strcmp(entry->name, name) == 0){
+            entry->hits += countHit;
+            return entry->path;
+        }
+    }
+
+    // Not hashed yet, search PATH and remember the result
+    char* found = searchPATH(name);
+    if (found == NULL){
+        return NULL;
+    }
+    entry = malloc(sizeof(struct hashedCommand));
+    entry->name = strdup(name);
+    entry->path = found;
+    entry->hits = countHit;
+    entry->next = commandHash[bucket];
+    commandHash[bucket] = entry;
+    return entry->path;
+}
+
+/* Grows the job table to twice its size and rehashes the running jobs into the new buckets */
+void growJobTable(){
+    int newCapacity = (jobCapacity == 0) ? 16 : jobCapacity * 2;
+    jobTable = realloc(jobTable, newCapacity * sizeof(struct job));
+    free(jobBuckets);
+    jobBuckets = malloc(newCapacity * sizeof(int));
+
+    int i;
+    for (i = 0; i < newCapacity; i++){
+        jobBuckets[i] = -1;
+    }
+    // Existing slots are all in use (the table only grows when full), put them back into buckets
+    for (i = 0; i < jobCapacity; i++){
+        int bucket = jobTable[i].pid & (newCapacity - 1);
+        jobTable[i].next = jobBuckets[bucket];
+        jobBuckets[bucket] = i;
+    }
+    // New slots go onto the free list
+    for (i = jobCapacity; i < newCapacity; i++){
+        jobTable[i].pid = 0;
+        jobTable[i].commandLine = NULL;
+        jobTable[i].next = (i + 1 < newCapacity) ? i + 1 : -1;
+    }
+    freeJobSlot = jobCapacity;
+    jobCapacity = newCapacity;
+}
+
+/* Returns the number for a new job, numbers start back at 1 whenever there are no jobs running */
+int newJobNumber(){
+    if (numberOfJobs == 0){
+        lastJobNumber = 0;
+    }
+    return ++lastJobNumber;
+}
+
+/* Adds a newly launched background process to the job table, returns its entry */
+/* commandLine is malloc'd and owned by the table, it is NULL for pipeline stages other than the one reported as the job */
+struct job* addJob(pid_t jobPid, pid_t processGroup, int jobNumber, char* commandLine){
+    if (freeJobSlot == -1){
+        growJobTable();
+    }
+    int slot = freeJobSlot;
+    struct job* newJob = &jobTable[slot];
+    freeJobSlot = newJob->next;
+
+    newJob->pid = jobPid;
+    newJob->processGroup = processGroup;
+    newJob->jobNumber = jobNumber;
+    newJob->commandLine = commandLine;
+
+    // Watch for the process terminating with a pidfd, without one (no kernel support, or out of file descriptors with
+    // thousands of jobs) SIGCHLD triggers a scan for terminated jobs instead
+    newJob->pidfd = -1;
+#ifdef SYS_pidfd_open
+    if (pidfdSupported){
+        newJob->pidfd = syscall(SYS_pidfd_open, jobPid, 0);
+        if (newJob->pidfd != -1){
+            struct epoll_event event = {0};
+            event.events = EPOLLIN;
+            event.data.u64 = ((uint64_t)EVENT_JOB << 32) | (uint32_t)jobPid;
+            if (epoll_ctl(eventFD, EPOLL_CTL_ADD, newJob->pidfd, &event) == -1){
+                close(newJob->pidfd);
+                newJob->pidfd = -1;
+            }
+        }
+    }
+#endif
+    if (newJob->pidfd == -1){
+        unwatchedJobs++;
+    }
+
+    int bucket = jobPid & (jobCapacity - 1);
+    newJob->next = jobBuckets[bucket];
+    jobBuckets[bucket] = slot;
+    numberOfJobs++;
+    return newJob;
+}
+
+/* Returns the job table entry for a pid, or NULL if the pid isn't a background job of this shell */
+struct job* findJob(pid_t jobPid){
+    if (jobCapacity == 0 || jobPid <= 0){
+        return NULL;
+    }
+    int slot;
+    for (slot = jobBuckets[jobPid & (jobCapacity - 1)]; slot != -1; slot = jobTable[slot].next){
+        if (jobTable[slot].pid == jobPid){
+            return &jobTable[slot];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the job with the given job number, or NULL if there is none */
+struct job* findJobNumber(int jobNumber){
+    int slot;
+    for (slot = 0; slot < jobCapacity; slot++){
+        if (jobTable[slot].pid != 0 && jobTable[slot].jobNumber == jobNumber && jobTable[slot].commandLine != NULL){
+            return &jobTable[slot];
+        }
+    }
+    return NULL;
+}
+
+/* Removes a job from the table once it has been reaped, its slot goes back on the free list */
+void removeJob(pid_t jobPid){
+    if (jobCapacity == 0){
+        return;
+    }
+    int* link = &jobBuckets[jobPid & (jobCapacity - 1)];
+    while (*link != -1){
+        int slot = *link;
+        if (jobTable[slot].pid == jobPid){
+            *link = jobTable[slot].next;
+            if (jobTable[slot].pidfd != -1){
+                close(jobTable[slot].pidfd); // Closing also takes it out of the epoll set
+                jobTable[slot].pidfd = -1;
+            }
+            else {
+                unwatchedJobs--;
+            }
+            free(jobTable[slot].commandLine);
+            jobTable[slot].commandLine = NULL;
+            jobTable[slot].pid = 0;
+            jobTable[slot].next = freeJobSlot;
+            freeJobSlot = slot;
+            numberOfJobs--;
+            return;
+        }
+        link = &jobTable[slot].next;
+    }
+}
+
+/* Returns the seconds elapsed since a CLOCK_MONOTONIC time */
+double secondsSince(struct timespec* started){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+}
+
+/* Adds the resources a reaped process used to a job's totals */
+void addUsage(struct jobStats* stats, struct rusage* usage){
+    stats->userSeconds += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    stats->systemSeconds += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+    if (usage->ru_maxrss > stats->maxRSS){
+        stats->maxRSS = usage->ru_maxrss;
+    }
+    stats->voluntarySwitches += usage->ru_nvcsw;
+    stats->involuntarySwitches += usage->ru_nivcsw;
+}
+
+/* Prints a job's resource use on one line */
+void printJobStats(FILE* out, struct jobStats* stats){
+    fprintf(out, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB csw %ld/%ld\n", stats->wallSeconds, stats->userSeconds,
+        stats->systemSeconds, stats->maxRSS, stats->voluntarySwitches, stats->involuntarySwitches);
+    fflush(out);
+}
+
+/* Records the resources used by a finished job, prints them for a timed job and reports or logs them if accounting is on */
+void accountJob(int timed, pid_t jobPid, const char* commandLine, int childExitMethod, struct jobStats* stats){
+    lastJobStats = *stats;
+    if (timed || (accountingOn && accountingLog == NULL)){
+        printJobStats(stderr, stats);
+    }
+    if (accountingOn && accountingLog != NULL){
+        // CSV columns: pid,command,status,wall,user,sys,maxrss_kb,voluntary_csw,involuntary_csw
+        fprintf(accountingLog, "%d,\"", jobPid);
+        const char* c;
+        for (c = (commandLine != NULL) ? commandLine : ""; *c != '\0'; c++){
+            if (*c == '"') fputc('"', accountingLog);
+            fputc(*c, accountingLog);
+        }
+        fprintf(accountingLog, "\",%s %d,%.6f,%.6f,%.6f,%ld,%ld,%ld\n", WIFSIGNALED(childExitMethod) ? "signal" : "exit",
+            WIFSIGNALED(childExitMethod) ? WTERMSIG(childExitMethod) : WEXITSTATUS(childExitMethod), stats->wallSeconds,
+            stats->userSeconds, stats->systemSeconds, stats->maxRSS, stats->voluntarySwitches, stats->involuntarySwitches);
+        fflush(accountingLog);
+    }
+}
+
+void startQueuedJobs(); // Defined below with the other launch functions
+
+/* Prints the message for a finished background process and removes it from the job table */
+/* Earlier stages of a pipeline are removed quietly, the job is reported once for its last stage, which frees its */
+/* slot under the parallel -j cap for the next queued command */
+/* usage is the rusage wait4 returned for the process, for a pipeline the job's numbers are those of its last stage */
+void reportJob(pid_t jobPid, int childExitMethod, struct rusage* usage){
+    struct job* doneJob = findJob(jobPid);
+    if (doneJob != NULL && doneJob->commandLine == NULL){
+        removeJob(jobPid);
+        return;
+    }
+
+    // If background process terminated normally, print out that status to terminal
+    beginNotice();
+    if (WIFEXITED(childExitMethod)){
+        int exitStatus = WEXITSTATUS(childExitMethod);
+        printf("background pid %d is done: exit value %d\n", jobPid, exitStatus);
+        fflush(stdout);
+    }
+    // If background process terminated by signal, print that status to terminal
+    else if (WIFSIGNALED(childExitMethod)) {
+        int termSignal = WTERMSIG(childExitMethod);
+        printf("background pid %d is done: terminated by signal %d\n", jobPid, termSignal);
+        fflush(stdout);
+    }
+    if (doneJob != NULL){
+        struct jobStats stats = {0};
+        addUsage(&stats, usage);
+        stats.wallSeconds = secondsSince(&doneJob->started);
+        accountJob(doneJob->timed, jobPid, doneJob->commandLine, childExitMethod, &stats);
+    }
+    removeJob(jobPid);
+    activeJobs--;
+    startQueuedJobs();
+}
+
+/* Reaps every background job that has terminated, without blocking, used when pidfds aren't available */
+void reapJobs(){
+    pid_t donePid;
+    int childExitMethod;
+    struct rusage usage;
+    while ((donePid = wait4(-1, &childExitMethod, WNOHANG, &usage)) > 0){
+        if (findJob(donePid) != NULL){
+            reportJob(donePid, childExitMethod, &usage);
+        }
+    }
+}
+
+/* Reaps the jobs that have no pidfd once they have terminated, for when pidfds ran out but others are still watched */
+/* Slots keep their index when the table grows, so it is safe for a reported job to start a queued one meanwhile */
+void reapUnwatchedJobs(){
+    int childExitMethod;
+    struct rusage usage;
+    int slot;
+    for (slot = 0; slot < jobCapacity && unwatchedJobs > 0; slot++){
+        pid_t jobPid = jobTable[slot].pid;
+        if (jobPid != 0 && jobTable[slot].pidfd == -1 && wait4(jobPid, &childExitMethod, WNOHANG, &usage) == jobPid){
+            reportJob(jobPid, childExitMethod, &usage);
+        }
+    }
+}
+
+/* Handles the signals queued on signalFD, SIGTSTP toggles foreground only mode, SIGCHLD reaps jobs that have no */
+/* pidfd, SIGINT is ignored by the shell but gives a fresh prompt if it arrives while the user is typing */
+void handleSignals(){
+    struct signalfd_siginfo info;
+    while (read(signalFD, &info, sizeof(info)) == sizeof(info)){
+        if (info.ssi_signo == SIGTSTP){
+            foregroundOnlyMode = !foregroundOnlyMode;
+            reportModeChange();
+        }
+        else if (info.ssi_signo == SIGCHLD){
+            if (!pidfdSupported){
+                reapJobs();
+            }
+            else if (unwatchedJobs > 0){
+                reapUnwatchedJobs();
+            }
+        }
+        else if (info.ssi_signo == SIGINT){
+            interrupted = 1;
+            beginNotice();
+        }
+    }
+}
+
+/* Waits up to timeout milliseconds (-1 for no limit) for events and handles them, returns 1 if input is ready to read */
+int dispatchEvents(int timeout){
+    struct epoll_event events[32];
+    int inputReady = 0;
+    int count, i;
+    while ((count = epoll_wait(eventFD, events, 32, timeout)) == -1 && errno == EINTR){}
+
+    for (i = 0; i < count; i++){
+        int kind = events[i].data.u64 >> 32;
+        pid_t jobPid = (pid_t)(events[i].data.u64 & 0xffffffff);
+        if (kind == EVENT_INPUT){
+            inputReady = 1;
+        }
+        else if (kind == EVENT_SIGNAL){
+            handleSignals();
+        }
+        else if (kind == EVENT_JOB && findJob(jobPid) != NULL){
+            // The job's pidfd is readable, so it has terminated and can be reaped right away
+            int childExitMethod;
+            struct rusage usage;
+            if (wait4(jobPid, &childExitMethod, WNOHANG, &usage) > 0){
+                reportJob(jobPid, childExitMethod, &usage);
+            }
+        }
+    }
+    return inputReady;
+}
+
+/* Sets up the epoll set: SIGCHLD, SIGTSTP and SIGINT are blocked and read from a signalfd instead of having handlers, */
+/* input is added if epoll can wait on it, and background processes are added as they launch */
+void setupEventLoop(int fd){
+    // SIGINT and SIGTSTP are ignored so children inherit that, being blocked they still queue on the signalfd
+    ignore_action.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore_action, NULL);
+    sigaction(SIGTSTP, &ignore_action, NULL);
+
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGTSTP);
+    sigaddset(&handled, SIGINT);
+    sigprocmask(SIG_BLOCK, &handled, NULL);
+    signalFD = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    eventFD = epoll_create1(EPOLL_CLOEXEC);
+    if (signalFD == -1 || eventFD == -1){
+        perror("smallsh: event loop");
+        exit(1);
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    epoll_ctl(eventFD, EPOLL_CTL_ADD, signalFD, &event);
+
+    // Regular files can't be added to epoll, they are always ready and just read when the next line is needed
+    event.data.u64 = (uint64_t)EVENT_INPUT << 32;
+    inputPollable = (epoll_ctl(eventFD, EPOLL_CTL_ADD, fd, &event) == 0);
+    inputFD = fd;
+
+    // Check that the kernel has pidfds, otherwise fall back to SIGCHLD
+#ifdef SYS_pidfd_open
+    int probe = syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe != -1){
+        pidfdSupported = 1;
+        close(probe);
+    }
+#endif
+}
+
+/* Gives a forked copy of the shell an empty job table and an epoll set of its own, the parent's jobs aren't the copy's */
+/* to reap, report or kill and the jobs the copy starts mustn't be watched from the parent's epoll set */
+void forgetJobs(){
+    jobTable = NULL;
+    jobBuckets = NULL;
+    jobCapacity = 0;
+    freeJobSlot = -1;
+    numberOfJobs = 0;
+    activeJobs = 0;
+    unwatchedJobs = 0;
+    lastJobNumber = 0;
+    jobQueueHead = NULL;
+    jobQueueTail = NULL;
+    queuedJobCount = 0;
+
+    close(eventFD);
+    eventFD = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    epoll_ctl(eventFD, EPOLL_CTL_ADD, signalFD, &event);
+    inputPollable = 0; // The copy never reads input
+}
+
+/* Stops or resumes watching the input, waiting for something other than a line mustn't wake up for typed input */
+void watchInput(int watch){
+    if (inputPollable){
+        struct epoll_event event = {0};
+        event.events = watch ? EPOLLIN : 0;
+        event.data.u64 = (uint64_t)EVENT_INPUT << 32;
+        epoll_ctl(eventFD, EPOLL_CTL_MOD, inputFD, &event);
+    }
+}
+
+/* Returns the next line of input, or NULL once it runs out, handling job completions and signals while it waits so */
+/* they are reported as soon as they happen rather than when the next line is entered */
+char* waitForLine(struct inputReader* reader){
+    while (1){
+        char* line = takeLine(reader);
+        if (line != NULL || reader->atEOF){
+            return line;
+        }
+        if (inputPollable){
+            atPrompt = 1;
+            int inputReady = dispatchEvents(-1);
+            atPrompt = 0;
+            if (inputReady){
+                fillReader(reader);
+            }
+            // Show the prompt again below anything that was printed while the user was at it
+            if (promptInterrupted){
+                promptInterrupted = 0;
+                printf("%s", prompt);
+                fflush(stdout);
+            }
+        }
+        else {
+            fillReader(reader);
+        }
+    }
+}
+
+void mapHistory();
+
+/* Opens the history file ($HISTFILE, or ~/.smallsh_history) for appending and maps it, nothing is read at startup so */
+/* this costs the same however long the history is, entries are only indexed when history is first used */
+void openHistory(){
+    const char* file = getVariable("HISTFILE");
+    const char* home = getVariable("HOME");
+    if (file == NULL){
+        if (home == NULL) return;
+        historyPath = malloc(strlen(home) + sizeof("/.smallsh_history"));
+        sprintf(historyPath, "%s/.smallsh_history", home);
+    }
+    else {
+        historyPath = strdup(file);
+    }
+    historyFD = open(historyPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (historyFD == -1){
+        return;
+    }
+
+    // A line cut off by a crash would run into the next one
+    struct stat info;
+    char last;
+    if (fstat(historyFD, &info) == 0 && info.st_size > 0 && pread(historyFD, &last, 1, info.st_size - 1) == 1 && last != '\n'){
+        write(historyFD, "\n", 1);
+    }
+    mapHistory();
+}
+
+/* Drops the mapping and the index of the history file, for when historyFD changes to another file */
+void unmapHistory(){
+    if (historyMap != NULL){
+        munmap(historyMap, historyMapSize);
+    }
+    historyMap = NULL;
+    historyMapSize = 0;
+    historyIndexed = 0;
+    historyCount = 0;
+}
+
+/* Returns 1 if historyFD is no longer the file at historyPath, because another shell has rotated it */
+int historyMoved(){
+    struct stat pathInfo, fdInfo;
+    return stat(historyPath, &pathInfo) == -1 || fstat(historyFD, &fdInfo) == -1 ||
+           pathInfo.st_dev != fdInfo.st_dev || pathInfo.st_ino != fdInfo.st_ino;
+}
+
+/* Reopens historyPath if another shell has rotated the file, so this shell doesn't go on appending to the old one */
+void followHistory(){
+    if (historyFD == -1 || !historyMoved()){
+        return;
+    }
+    unmapHistory();
+    close(historyFD);
+    historyFD = open(historyPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+/* Maps the history file again if it has changed size, entries this and other shells appended become visible */
+void mapHistory(){
+    struct stat info;
+    followHistory();
+    if (historyFD == -1 || fstat(historyFD, &info) == -1 || (size_t)info.st_size == historyMapSize){
+        return;
+    }
+    if (historyMap != NULL){
+        munmap(historyMap, historyMapSize);
+        historyMap = NULL;
+    }
+    historyMapSize = info.st_size;
+    if (historyMapSize > 0){
+        historyMap = mmap(NULL, historyMapSize, PROT_READ, MAP_SHARED, historyFD, 0);
+        if (historyMap == MAP_FAILED){
+            historyMap = NULL;
+            historyMapSize = 0;
+        }
+    }
+    // Shrunk under us, the index no longer fits it
+    if (historyIndexed > historyMapSize){
+        historyIndexed = 0;
+        historyCount = 0;
+    }
+}
+
+/* Brings the index of line starts up to date with the mapping, only the part added since the last call is scanned */
+void indexHistory(){
+    mapHistory();
+    char* newline;
+    while (historyIndexed < historyMapSize &&
+           (newline = memchr(historyMap + historyIndexed, '\n', historyMapSize - historyIndexed)) != NULL){
+        if (historyCount == historyCapacity){
+            historyCapacity = (historyCapacity == 0) ? 1024 : historyCapacity * 2;
+            historyIndex = realloc(historyIndex, historyCapacity * sizeof(size_t));
+        }
+        historyIndex[historyCount++] = historyIndexed;
+        historyIndexed = newline + 1 - historyMap;
+    }
+}
+
+/* Returns history entry n (counting from 0) in the mapping and sets its length */
+const char* historyEntry(int n, size_t* length){
+    const char* entry = historyMap + historyIndex[n];
+    *length = (char*)memchr(entry, '\n', historyMapSize - historyIndex[n]) - entry;
+    return entry;
+}
+
+/* Starts a new history file once it would grow past HISTORY_MAX_BYTES, the old one is kept as FILE.1 and the newest */
+/* quarter of it is carried over so recent entries can still be recalled */
+/* Shells sharing the file rotate it under a lock, one that was waiting finds it already rotated and just follows */
+void rotateHistory(){
+    flock(historyFD, LOCK_EX);
+    if (historyMoved()){
+        flock(historyFD, LOCK_UN);
+        followHistory();
+        return;
+    }
+    mapHistory();
+    size_t carry = historyMapSize - HISTORY_MAX_BYTES / 4;
+    char* start = (historyMapSize > HISTORY_MAX_BYTES / 4) ? memchr(historyMap + carry, '\n', historyMapSize - carry) : NULL;
+    char* newPath = malloc(strlen(historyPath) + 5);
+    char* oldPath = malloc(strlen(historyPath) + 3);
+    sprintf(newPath, "%s.new", historyPath);
+    sprintf(oldPath, "%s.1", historyPath);
+    int newFD = open(newPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (newFD != -1){
+        if (start != NULL){
+            write(newFD, start + 1, historyMap + historyMapSize - start - 1);
+        }
+        rename(historyPath, oldPath);
+        rename(newPath, historyPath);
+        unmapHistory();
+        close(historyFD); // Releases the lock
+        historyFD = newFD;
+        mapHistory();
+    }
+    else {
+        flock(historyFD, LOCK_UN);
+    }
+    free(newPath);
+    free(oldPath);
+}
+
+/* Appends a line to the history file with a single write */
+void addHistory(const char* line){
+    struct stat info;
+    followHistory();
+    if (historyFD == -1){
+        return;
+    }
+    size_t length = strlen(line);
+    if (fstat(historyFD, &info) == 0 && (size_t)info.st_size + length + 1 > HISTORY_MAX_BYTES){
+        rotateHistory();
+    }
+    struct iovec pieces[2] = { { (void*)line, length }, { "\n", 1 } };
+    writev(historyFD, pieces, 2);
+}
+
+/* Finds the history entry an event names: !! the last one, !n entry n, !-n the nth last, !?text the last containing */
+/* text and !prefix the last starting with prefix, spec is what follows the ! and the search runs from the newest entry */
+/* Returns the entry and sets its length, or returns NULL if there is no such entry */
+const char* findEvent(const char* spec, size_t specLength, size_t* length){
+    indexHistory();
+    int n = -1;
+    if (specLength == 1 && spec[0] == '!'){
+        n = historyCount - 1;
+    }
+    else if (spec[0] >= '0' && spec[0] <= '9'){
+        n = atoi(spec) - 1;
+    }
+    else if (spec[0] == '-' && specLength > 1){
+        n = historyCount - atoi(spec + 1);
+    }
+    else {
+        int contains = (spec[0] == '?');
+        if (contains){
+            spec++;
+            specLength--;
+            if (specLength > 0 && spec[specLength - 1] == '?') specLength--;
+        }
+        for (n = historyCount - 1; n >= 0; n--){
+            const char* entry = historyEntry(n, length);
+            if (contains ? memmem(entry, *length, spec, specLength) != NULL : (*length >= specLength && memcmp(entry, spec, specLength) == 0)){
+                return entry;
+            }
+        }
+    }
+    if (n < 0 || n >= historyCount){
+        return NULL;
+    }
+    return historyEntry(n, length);
+}
+
+/* Replaces history events (words starting with ! other than ! alone or != ) in a line with the entries they name */
+/* Returns the line, a new line from the command arena if anything was replaced, or NULL if an event wasn't found */
+char* expandHistory(char* line){
+    char* event = line;
+    while ((event = strchr(event, '!')) != NULL && ((event != line && event[-1] != ' ' && event[-1] != '\t') ||
+           event[1] == '\0' || event[1] == ' ' || event[1] == '\t' || event[1] == '=')){
+        event++;
+    }
+    if (event == NULL){
+        return line;
+    }
+
+    // Copy the line, expanding each event, into a buffer that grows as entries are added
+    size_t capacity = strlen(line) * 2 + 64, used = 0;
+    char* expanded = arenaAlloc(&commandArena, capacity);
+    char* cursor = line;
+    while (*cursor != '\0'){
+        const char* piece = cursor;
+        size_t pieceLength = 1;
+        if (cursor[0] == '!' && (cursor == line || cursor[-1] == ' ' || cursor[-1] == '\t') &&
+            cursor[1] != '\0' && cursor[1] != ' ' && cursor[1] != '\t' && cursor[1] != '='){
+            size_t specLength = (cursor[1] == '!') ? 1 : strcspn(cursor + 1, " \t");
+            piece = findEvent(cursor + 1, specLength, &pieceLength);
+            if (piece == NULL){
+                printf("!%.*s: event not found\n", (int)specLength, cursor + 1);
+                fflush(stdout);
+                return NULL;
+            }
+            cursor += specLength + 1;
+        }
+        else {
+            cursor++;
+        }
+        if (used + pieceLength + 1 > capacity){
+            capacity = (used + pieceLength + 1) * 2;
+            char* grown = arenaAlloc(&commandArena, capacity);
+            memcpy(grown, expanded, used);
+            expanded = grown;
+        }
+        memcpy(expanded + used, piece, pieceLength);
+        used += pieceLength;
+    }
+    expanded[used] = '\0';
+
+    // Show the command that is actually run, like other shells
+    printf("%s\n", expanded);
+    fflush(stdout);
+    return expanded;
+}
+
+/* Built in command to list the history, "history N" lists the last N entries */
+int builtinHistory(struct userCommand* currentCommand){
+    indexHistory();
+    int first = 0;
+    if (currentCommand->argument[0] != NULL){
+        first = historyCount - atoi(currentCommand->argument[0]);
+        if (first < 0) first = 0;
+    }
+    int i;
+    size_t length;
+    for (i = first; i < historyCount; i++){
+        const char* entry = historyEntry(i, &length);
+        printf("%5d  %.*s\n", i + 1, (int)length, entry);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* Built in command to change directory, changes to HOME directory if no argument provided, returns 1 if it failed */
+int builtinCD(struct userCommand* currentCommand){
+    // Define home directory
+    const char* home = getVariable("HOME");
+    int result;
+
+    // Given no arguments, change directory to HOME
+    if (currentCommand->argument[0] == NULL){
+        result = chdir(home);
+    }
+    // Given an argument, change directory according to argument (relative or absolute paths handled)
+    else {
+        // Lines have no length limit, so the argument is passed as it is rather than copied into a PATH_MAX buffer
+        const char* givenPath = currentCommand->argument[0];
+
+        // Go to home
+        if (strcmp(givenPath, "~") == 0){
+            result = chdir(home);
+        }
+        // Go to path specified
+        else {
+            result = chdir(givenPath);
+        }
+    }
+    return (result == -1) ? 1 : 0;
+}
+
+/* Built in command to print out exit status or terminating signal of the last foreground process ran by shell */
+/* With accounting on, the resources used by the last job to finish are printed as well */
+int builtinStatus(struct userCommand* currentCommand){
+    // If exitTrue Boolean, print out the last exit status, otherwise print out the last terminating signal
+    if (exitTrue){
+        printf("exit value %d\n", statusExit);
+        fflush(stdout);
+    }
+    else{
+        printf("terminated by signal %d\n", statusSignal);
+        fflush(stdout);
+    }
+    if (accountingOn){
+        printJobStats(stdout, &lastJobStats);
+    }
+    return 0;
+}
+
+/* Built in command to turn job accounting on or off, "acct on FILE" appends each job's resource use to FILE as CSV */
+/* instead of printing it after the job */
+int builtinAcct(struct userCommand* currentCommand){
+    if (currentCommand->argument[0] == NULL){
+        printf("accounting %s\n", accountingOn ? "on" : "off");
+        fflush(stdout);
+        return 0;
+    }
+    if (accountingLog != NULL){
+        fclose(accountingLog);
+        accountingLog = NULL;
+    }
+    accountingOn = (strcmp(currentCommand->argument[0], "on") == 0);
+    if (accountingOn && currentCommand->argument[1] != NULL){
+        int logFD = open(currentCommand->argument[1], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (logFD == -1 || (accountingLog = fdopen(logFD, "a")) == NULL){
+            printf("cannot open %s file for accounting\n", currentCommand->argument[1]);
+            fflush(stdout);
+            accountingOn = 0;
+            return 0;
+        }
+        // New log files start with a header line
+        if (lseek(logFD, 0, SEEK_END) == 0){
+            fprintf(accountingLog, "pid,command,status,wall,user,sys,maxrss_kb,voluntary_csw,involuntary_csw\n");
+            fflush(accountingLog);
+        }
+    }
+    return 0;
+}
+
+/* Built in command to exit shell, kills any other processes or jobs started by the shell before terminating itself */
+int builtinExit(struct userCommand* currentCommand){
+    // Iterate over the job table and kill all processes still running, queued commands are never started
+    int i;
+    for (i = 0; i < jobCapacity; i++){
+        if (jobTable[i].pid != 0){
+            kill(jobTable[i].pid, SIGKILL);
+        }
+    }
+    exit(0); // Terminates calling process (smallsh)
+}
+
+/* Built in command to leave the innermost loop, does nothing outside of one */
+int builtinBreak(struct userCommand* currentCommand){
+    if (loopDepth > 0){
+        loopControl = LOOP_BREAK;
+    }
+    return 0;
+}
+
+/* Built in command to go on to the next iteration of the innermost loop, does nothing outside of one */
+int builtinContinue(struct userCommand* currentCommand){
+    if (loopDepth > 0){
+        loopControl = LOOP_CONTINUE;
+    }
+    return 0;
+}
+
+/* Built in command to show or reset the hashed command table, "hash -r" forgets everything and "hash name" hashes name */
+int builtinHash(struct userCommand* currentCommand){
+    // Given no arguments, list the table
+    if (currentCommand->argument[0] == NULL){
+        int i, empty = 1;
+        struct hashedCommand* entry;
+        for (i = 0; i < COMMAND_HASH_BUCKETS; i++){
+            for (entry = commandHash[i]; entry != NULL; entry = entry->next){
+                if (empty){
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty){
+            printf("hash: hash table empty\n");
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    // Otherwise forget the table or look up each name given
+    int i;
+    for (i = 0; currentCommand->argument[i] != NULL; i++){
+        if (strcmp(currentCommand->argument[i], "-r") == 0){
+            clearCommandHash();
+        }
+        else if (lookupCommand(currentCommand->argument[i], 0) == NULL){
+            printf("hash: %s: not found\n", currentCommand->argument[i]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+void dropCachedLine(struct cachedLine* entry); // Defined below with the parser
+
+/* Built in command to show how well the parsed command cache is doing, "cache -r" empties it */
+int builtinCache(struct userCommand* currentCommand){
+    // The program running this is the most recently used one and is still needed
+    if (currentCommand->argument[0] != NULL && strcmp(currentCommand->argument[0], "-r") == 0){
+        while (oldestLine != newestLine){
+            dropCachedLine(oldestLine);
+        }
+        parseCacheHits = 0;
+        parseCacheMisses = 0;
+        return 0;
+    }
+    printf("%ld hits, %ld misses, %d of %d lines cached\n", parseCacheHits, parseCacheMisses, parseCacheCount, PARSE_CACHE_LIMIT);
+    fflush(stdout);
+    return 0;
+}
+
+/* Returns a malloc'd copy of the command line for a pipeline, for the jobs listing */
+char* describeCommand(struct userCommand* currentCommand){
+    size_t length = 1;
+    struct userCommand* stage;
+    int i;
+    for (stage = currentCommand; stage != NULL; stage = stage->nextStage){
+        for (i = 0; stage->argv[i] != NULL; i++){
+            length += strlen(stage->argv[i]) + 1;
+        }
+        length += 2;
+    }
+
+    char* commandLine = malloc(length);
+    char* out = commandLine;
+    for (stage = currentCommand; stage != NULL; stage = stage->nextStage){
+        if (stage != currentCommand){
+            out = stpcpy(out, "| ");
+        }
+        for (i = 0; stage->argv[i] != NULL; i++){
+            out = stpcpy(out, stage->argv[i]);
+            if (stage->argv[i + 1] != NULL || stage->nextStage != NULL) *out++ = ' ';
+        }
+    }
+    *out = '\0';
+    return commandLine;
+}
+
+/* Built in command to list the running background jobs */
+int builtinJobs(struct userCommand* currentCommand){
+    int slot;
+    for (slot = 0; slot < jobCapacity; slot++){
+        if (jobTable[slot].pid != 0 && jobTable[slot].commandLine != NULL){
+            printf("[%d] %d Running %s\n", jobTable[slot].jobNumber, jobTable[slot].pid, jobTable[slot].commandLine);
+        }
+    }
+    struct queuedJob* queued;
+    for (queued = jobQueueHead; queued != NULL; queued = queued->next){
+        char* commandLine = describeCommand(queued->command);
+        printf("[-] Queued %s\n", commandLine);
+        free(commandLine);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* Returns the pid named by a job argument, either %n for job number n or a plain pid, or -1 if there is no such job */
+pid_t jobArgumentPid(const char* argument){
+    if (argument[0] == '%'){
+        struct job* found = findJobNumber(atoi(argument + 1));
+        return (found == NULL) ? -1 : found->pid;
+    }
+    pid_t jobPid = atoi(argument);
+    return (jobPid > 0) ? jobPid : -1;
+}
+
+/* Waits until every background job has terminated, including the ones still queued under the parallel -j cap, or ^C */
+/* is pressed, returns 1 if it was interrupted. Jobs are reaped and reported by the event loop as they finish */
+int waitAllJobs(){
+    watchInput(0);
+    while (numberOfJobs > 0 && !interrupted){
+        dispatchEvents(-1);
+    }
+    watchInput(1);
+    return interrupted;
+}
+
+/* Built in command to wait for background jobs, waits for all of them if no pid or %n is given */
+/* ^C stops the wait, like other shells it then returns 128 + SIGINT */
+int builtinWait(struct userCommand* currentCommand){
+    // Given no arguments, wait until the job table is empty
+    if (currentCommand->argument[0] == NULL){
+        waitAllJobs();
+    }
+
+    // Otherwise wait for each job given
+    int i;
+    watchInput(0);
+    for (i = 0; currentCommand->argument[i] != NULL && !interrupted; i++){
+        pid_t jobPid = jobArgumentPid(currentCommand->argument[i]);
+        if (findJob(jobPid) == NULL){
+            printf("wait: %s is not a job of this shell\n", currentCommand->argument[i]);
+            fflush(stdout);
+            continue;
+        }
+        while (findJob(jobPid) != NULL && !interrupted){
+            dispatchEvents(-1);
+        }
+    }
+    watchInput(1);
+
+    // Move off the line the terminal echoed ^C on
+    if (interrupted && interactive){
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // A wait cut short by ^C is reported by status like a foreground command killed by it
+    if (interrupted){
+        statusExit = 128 + SIGINT;
+        exitTrue = 1;
+    }
+    return interrupted ? 128 + SIGINT : 0;
+}
+
+/* Built in command to send a signal (SIGTERM unless -signum is given) to a background job by %n or to a pid */
+/* Jobs are signalled through their process group so every stage of a pipeline gets it */
+int builtinKill(struct userCommand* currentCommand){
+    int signalNumber = SIGTERM;
+    int i = 0;
+    if (currentCommand->argument[0] != NULL && currentCommand->argument[0][0] == '-'){
+        signalNumber = atoi(currentCommand->argument[0] + 1);
+        i = 1;
+    }
+    for (; currentCommand->argument[i] != NULL; i++){
+        pid_t jobPid = jobArgumentPid(currentCommand->argument[i]);
+        struct job* target = findJob(jobPid);
+        if (target != NULL){
+            jobPid = -target->processGroup;
+        }
+        if (jobPid == -1 || kill(jobPid, signalNumber) == -1){
+            printf("kill: %s: no such job or process\n", currentCommand->argument[i]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+/* Built in command to cap how many background jobs run at once, "parallel -j N" queues background commands beyond N */
+/* until a running job finishes, -j 0 removes the cap and -j cpus uses the number of online processors */
+int builtinParallel(struct userCommand* currentCommand){
+    if (currentCommand->argument[0] == NULL){
+        printf("parallel -j %d (%d running, %d queued)\n", maxParallelJobs, activeJobs, queuedJobCount);
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(currentCommand->argument[0], "-j") != 0 || currentCommand->argument[1] == NULL){
+        printf("usage: parallel -j N\n");
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(currentCommand->argument[1], "cpus") == 0){
+        maxParallelJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    else {
+        maxParallelJobs = atoi(currentCommand->argument[1]);
+        if (maxParallelJobs < 0) maxParallelJobs = 0;
+    }
+    // Raising the cap can free slots right away
+    startQueuedJobs();
+    return 0;
+}
+
+/* Built in command to show or set the buffer size used for pipes between pipeline stages, 0 means the kernel default */
+int builtinPipesize(struct userCommand* currentCommand){
+    if (currentCommand->argument[0] == NULL){
+        printf("%d\n", pipeBufferSize);
+        fflush(stdout);
+        return 0;
+    }
+    pipeBufferSize = atoi(currentCommand->argument[0]);
+    if (pipeBufferSize < 0){
+        pipeBufferSize = 0;
+    }
+    return 0;
+}
+
+/* Parses a CPU list like 0-3,6 into set, returns -1 if it isn't one */
+int parseCPUList(const char* list, cpu_set_t* set){
+    CPU_ZERO(set);
+    const char* cursor = list;
+    while (*cursor != '\0'){
+        char* end;
+        long first = strtol(cursor, &end, 10), last;
+        if (end == cursor || first < 0) return -1;
+        last = first;
+        if (*end == '-'){
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (; first <= last; first++){
+            CPU_SET(first, set);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        cursor = end;
+    }
+    return CPU_COUNT(set) == 0 ? -1 : 0;
+}
+
+/* Parses a limit value, a number with an optional K, M or G suffix or "unlimited", returns -1 if it isn't one */
+int parseLimitValue(const char* text, rlim_t* value){
+    if (strcmp(text, "unlimited") == 0){
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char* end;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-') return -1;
+    switch (*end){
+        case 'G': case 'g': number *= 1024;
+        /* fall through */
+        case 'M': case 'm': number *= 1024;
+        /* fall through */
+        case 'K': case 'k': number *= 1024; end++;
+    }
+    if (*end != '\0') return -1;
+    *value = number;
+    return 0;
+}
+
+/* Built in command to set how background processes are launched: "-c LIST" pins them to CPUs, "-c auto" spreads them */
+/* round robin over the CPUs one each, "-n N" sets their nice value, "-l NAME=VALUE" sets a resource limit and -r goes back */
+/* to launching them like foreground commands, with no arguments the options are shown */
+int builtinJobopt(struct userCommand* currentCommand){
+    int i, j;
+    if (currentCommand->argument[0] == NULL){
+        printf("cpus ");
+        if (jobCPURoundRobin) printf("auto ");
+        if (jobCPUCount == 0) printf("any");
+        for (i = 0, j = 0; j < jobCPUCount; i++){
+            if (CPU_ISSET(i, &jobCPUs)) printf(j++ == 0 ? "%d" : ",%d", i);
+        }
+        if (jobNiceSet) printf(", nice %d", jobNice);
+        for (i = 0; i < jobLimitCount; i++){
+            for (j = 0; limitNames[j].resource != jobLimits[i].resource; j++){}
+            if (jobLimits[i].value == RLIM_INFINITY) printf(", %s unlimited", limitNames[j].name);
+            else printf(", %s %llu", limitNames[j].name, (unsigned long long)jobLimits[i].value);
+        }
+        printf("\n");
+        fflush(stdout);
+        return 0;
+    }
+
+    for (i = 0; currentCommand->argument[i] != NULL; i++){
+        const char* option = currentCommand->argument[i];
+        const char* value = currentCommand->argument[i + 1];
+        if (strcmp(option, "-r") == 0){
+            jobCPUCount = 0;
+            jobCPURoundRobin = 0;
+            jobNiceSet = 0;
+            jobLimitCount = 0;
+            continue;
+        }
+        if (value == NULL){
+            break;
+        }
+        i++;
+        if (strcmp(option, "-c") == 0){
+            if (strcmp(value, "auto") == 0){
+                jobCPURoundRobin = 1;
+            }
+            else if (strcmp(value, "any") == 0){
+                jobCPUCount = 0;
+                jobCPURoundRobin = 0;
+            }
+            else if (parseCPUList(value, &jobCPUs) == 0){
+                jobCPUCount = CPU_COUNT(&jobCPUs);
+            }
+            else {
+                printf("jobopt: %s: not a CPU list\n", value);
+                fflush(stdout);
+            }
+        }
+        else if (strcmp(option, "-n") == 0){
+            jobNice = atoi(value);
+            jobNiceSet = 1;
+        }
+        else if (strcmp(option, "-l") == 0){
+            const char* equals = strchr(value, '=');
+            rlim_t limit;
+            for (j = 0; j < LIMIT_NAMES; j++){
+                if (equals != NULL && strncmp(value, limitNames[j].name, equals - value) == 0 && limitNames[j].name[equals - value] == '\0') break;
+            }
+            if (j == LIMIT_NAMES || parseLimitValue(equals + 1, &limit) == -1){
+                printf("jobopt: %s: not a limit\n", value);
+                fflush(stdout);
+                continue;
+            }
+            // Setting a limit again replaces it
+            int k;
+            for (k = 0; k < jobLimitCount && jobLimits[k].resource != limitNames[j].resource; k++){}
+            jobLimits[k].resource = limitNames[j].resource;
+            jobLimits[k].value = limit;
+            if (k == jobLimitCount) jobLimitCount++;
+        }
+        else {
+            i--;
+            break;
+        }
+    }
+    if (currentCommand->argument[i] != NULL){
+        printf("usage: jobopt [-r] [-c LIST|auto|any] [-n NICE] [-l NAME=VALUE]\n");
+        fflush(stdout);
+    }
+    jobOptionsSet = (jobCPUCount != 0 || jobCPURoundRobin || jobNiceSet || jobLimitCount != 0);
+    return 0;
+}
+
+/* Sets a variable from a NAME=value word, returns NULL if the word isn't an assignment */
+struct shellVariable* assignVariable(const char* word){
+    size_t nameLength = variableNameLength(word);
+    if (nameLength == 0 || word[nameLength] != '='){
+        return NULL;
+    }
+    return setVariable(word, nameLength, word + nameLength + 1, strlen(word + nameLength + 1));
+}
+
+/* Built in command to pass variables to commands, "export NAME=value" sets the variable as well, with no arguments */
+/* the exported variables are listed */
+int builtinExport(struct userCommand* currentCommand){
+    if (currentCommand->argument[0] == NULL){
+        char** entry;
+        for (entry = shellEnvironment(); *entry != NULL; entry++){
+            printf("export %s\n", *entry);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    int i;
+    for (i = 0; currentCommand->argument[i] != NULL; i++){
+        struct shellVariable* variable = assignVariable(currentCommand->argument[i]);
+        if (variable == NULL){
+            variable = findVariable(currentCommand->argument[i], strlen(currentCommand->argument[i]));
+        }
+        if (variable != NULL){
+            exportVariable(variable);
+        }
+    }
+    return 0;
+}
+
+/* Built in command to remove variables */
+int builtinUnset(struct userCommand* currentCommand){
+    int i;
+    for (i = 0; currentCommand->argument[i] != NULL; i++){
+        unsetVariable(currentCommand->argument[i]);
+    }
+    return 0;
+}
+
+/* Return value of a built in that can't handle the arguments it was given, the command is run through exec instead */
+#define BUILTIN_FALLBACK -1
+
+/* Writes text to stdout interpreting backslash escapes, echoStyle selects \0nnn octal (echo -e) over \nnn (printf) */
+/* Returns 1 if a \c was found, which ends all output of the command */
+int printEscaped(const char* text, int echoStyle){
+    const char* cursor = text;
+    while (*cursor != '\0'){
+        if (*cursor != '\\' || cursor[1] == '\0'){
+            putchar(*cursor++);
+            continue;
+        }
+        cursor++;
+        int value = 0;
+        int digits;
+        switch (*cursor){
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'c': return 1;
+            case 'e': putchar('\033'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '\\': putchar('\\'); break;
+            case 'x':
+                // Up to 2 hex digits, a lone \x is printed as is
+                for (digits = 0; digits < 2 && strchr("0123456789abcdefABCDEF", cursor[1]) != NULL && cursor[1] != '\0'; digits++){
+                    cursor++;
+                    value = value * 16 + ((*cursor <= '9') ? *cursor - '0' : (*cursor | 0x20) - 'a' + 10);
+                }
+                if (digits == 0){
+                    putchar('\\');
+                    putchar('x');
+                }
+                else {
+                    putchar(value);
+                }
+                break;
+            default:
+                // Octal, echo wants a leading 0 and then up to 3 digits, printf takes up to 3 digits directly
+                if ((echoStyle && *cursor == '0') || (!echoStyle && *cursor >= '0' && *cursor <= '7')){
+                    if (echoStyle) cursor++;
+                    for (digits = 0; digits < 3 && *cursor >= '0' && *cursor <= '7'; digits++){
+                        value = value * 8 + (*cursor++ - '0');
+                    }
+                    putchar(value);
+                    continue;
+                }
+                putchar('\\');
+                putchar(*cursor);
+                break;
+        }
+        cursor++;
+    }
+    return 0;
+}
+
+/* Built in echo, prints its arguments separated by spaces, -n leaves off the newline and -e interprets escapes */
+int builtinEcho(struct userCommand* currentCommand){
+    int newline = 1, escapes = 0;
+    int i = 0;
+    // Only words made up entirely of n, e and E after a dash are options, like bash
+    for (; currentCommand->argument[i] != NULL; i++){
+        const char* option = currentCommand->argument[i];
+        if (option[0] != '-' || option[1] == '\0' || strspn(option + 1, "neE") != strlen(option + 1)){
+            break;
+        }
+        for (option++; *option != '\0'; option++){
+            if (*option == 'n') newline = 0;
+            else escapes = (*option == 'e');
+        }
+    }
+    for (; currentCommand->argument[i] != NULL; i++){
+        if (escapes){
+            if (printEscaped(currentCommand->argument[i], 1)){
+                newline = 0;
+                break;
+            }
+        }
+        else {
+            fputs(currentCommand->argument[i], stdout);
+        }
+        if (currentCommand->argument[i + 1] != NULL) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return (fflush(stdout) == EOF) ? 1 : 0;
+}
+
+/* Built in true and false, they only set the exit status */
+int builtinTrue(struct userCommand* currentCommand){
+    return 0;
+}
+
+int builtinFalse(struct userCommand* currentCommand){
+    return 1;
+}
+
+/* Built in pwd, prints the physical current directory, options are left to the external pwd */
+int builtinPwd(struct userCommand* currentCommand){
+    if (currentCommand->argument[0] != NULL){
+        return BUILTIN_FALLBACK;
+    }
+    char buff[PATH_MAX + 1];
+    if (getcwd(buff, sizeof(buff)) == NULL){
+        return BUILTIN_FALLBACK;
+    }
+    puts(buff);
+    return (fflush(stdout) == EOF) ? 1 : 0;
+}
+
+/* Parses a whole decimal integer for test, returns 0 if text isn't one */
+int parseInteger(const char* text, long long* value){
+    char* end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    return (end != text && *end == '\0' && errno == 0);
+}
+
+/* Evaluates a unary test operator, returns 0 for true, 1 for false or BUILTIN_FALLBACK if op isn't one handled here */
+int testUnary(const char* op, const char* operand){
+    struct stat info;
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0'){
+        return BUILTIN_FALLBACK;
+    }
+    switch (op[1]){
+        case 'z': return operand[0] != '\0';
+        case 'n': return operand[0] == '\0';
+        case 't': return !isatty(atoi(operand));
+        case 'r': return access(operand, R_OK) != 0;
+        case 'w': return access(operand, W_OK) != 0;
+        case 'x': return access(operand, X_OK) != 0;
+        case 'L':
+        case 'h': return lstat(operand, &info) != 0 || !S_ISLNK(info.st_mode);
+        case 'e': case 'f': case 'd': case 's': case 'p': case 'S': case 'b': case 'c':
+            break;
+        default:
+            return BUILTIN_FALLBACK;
+    }
+    if (stat(operand, &info) != 0){
+        return 1;
+    }
+    switch (op[1]){
+        case 'f': return !S_ISREG(info.st_mode);
+        case 'd': return !S_ISDIR(info.st_mode);
+        case 's': return info.st_size == 0;
+        case 'p': return !S_ISFIFO(info.st_mode);
+        case 'S': return !S_ISSOCK(info.st_mode);
+        case 'b': return !S_ISBLK(info.st_mode);
+        case 'c': return !S_ISCHR(info.st_mode);
+    }
+    return 0;
+}
+
+/* Evaluates a binary test operator, returns 0 for true, 1 for false or BUILTIN_FALLBACK if op isn't one handled here */
+int testBinary(const char* left, const char* op, const char* right){
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) != 0;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) == 0;
+
+    // File times, a file that doesn't exist is older than one that does
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0){
+        struct stat leftInfo, rightInfo;
+        int leftExists = (stat(left, &leftInfo) == 0), rightExists = (stat(right, &rightInfo) == 0);
+        int newer;
+        if (!leftExists || !rightExists){
+            newer = leftExists - rightExists;
+        }
+        else if (leftInfo.st_mtim.tv_sec != rightInfo.st_mtim.tv_sec){
+            newer = (leftInfo.st_mtim.tv_sec > rightInfo.st_mtim.tv_sec) ? 1 : -1;
+        }
+        else {
+            newer = (leftInfo.st_mtim.tv_nsec > rightInfo.st_mtim.tv_nsec) - (leftInfo.st_mtim.tv_nsec < rightInfo.st_mtim.tv_nsec);
+        }
+        return (op[1] == 'n') ? !(newer > 0) : !(newer < 0);
+    }
+
+    // Integer comparisons, anything that isn't a number is left to the external test to report
+    static const char* integerOps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int i;
+    for (i = 0; i < 6; i++){
+        if (strcmp(op, integerOps[i]) == 0) break;
+    }
+    long long leftValue, rightValue;
+    if (i == 6 || !parseInteger(left, &leftValue) || !parseInteger(right, &rightValue)){
+        return BUILTIN_FALLBACK;
+    }
+    switch (i){
+        case 0: return !(leftValue == rightValue);
+        case 1: return !(leftValue != rightValue);
+        case 2: return !(leftValue < rightValue);
+        case 3: return !(leftValue <= rightValue);
+        case 4: return !(leftValue > rightValue);
+        default: return !(leftValue >= rightValue);
+    }
+}
+
+/* Evaluates test arguments with the POSIX rules based on how many there are, returns 0 for true, 1 for false */
+/* More than 4 arguments (-a, -o and longer parenthesized expressions) are left to the external test */
+int evaluateTest(int count, char** args){
+    int result;
+    switch (count){
+        case 0:
+            return 1;
+        case 1:
+            return args[0][0] == '\0';
+        case 2:
+            if (strcmp(args[0], "!") == 0) return !evaluateTest(1, args + 1);
+            return testUnary(args[0], args[1]);
+        case 3:
+            result = testBinary(args[0], args[1], args[2]);
+            if (result != BUILTIN_FALLBACK) return result;
+            if (strcmp(args[0], "!") == 0){
+                result = evaluateTest(2, args + 1);
+                return (result == BUILTIN_FALLBACK) ? result : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) return evaluateTest(1, args + 1);
+            return BUILTIN_FALLBACK;
+        case 4:
+            if (strcmp(args[0], "!") == 0){
+                result = evaluateTest(3, args + 1);
+                return (result == BUILTIN_FALLBACK) ? result : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) return evaluateTest(2, args + 1);
+            return BUILTIN_FALLBACK;
+    }
+    return BUILTIN_FALLBACK;
+}
+
+/* Built in test and [, the [ form needs a closing ] as its last argument */
+int builtinTest(struct userCommand* currentCommand){
+    int count = currentCommand->argumentCount;
+    if (strcmp(currentCommand->command, "[") == 0){
+        if (count == 0 || strcmp(currentCommand->argument[count - 1], "]") != 0){
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        count--;
+    }
+    return evaluateTest(count, currentCommand->argument);
+}
+
+/* Built in printf, the format is reused until the arguments run out, conversions are done by the C library */
+/* Formats with * widths or %b, or with conversions not listed here, are left to the external printf */
+int builtinPrintf(struct userCommand* currentCommand){
+    const char* format = currentCommand->argument[0];
+    if (format == NULL){
+        return BUILTIN_FALLBACK;
+    }
+
+    // Check the whole format first so nothing is printed before falling back
+    const char* cursor;
+    for (cursor = format; *cursor != '\0'; cursor++){
+        if (*cursor == '%'){
+            cursor++;
+            cursor += strspn(cursor, "-+ #0123456789.");
+            if (*cursor == '\0' || strchr("%diouxXcseEfFgGaA", *cursor) == NULL){
+                return BUILTIN_FALLBACK;
+            }
+        }
+    }
+
+    char** args = currentCommand->argument + 1;
+    int status = 0;
+    char spec[64];
+    do {
+        char** passStart = args;
+        for (cursor = format; *cursor != '\0'; cursor++){
+            if (*cursor == '\\'){
+                // Hand the escape (and anything up to the next % or \) to printEscaped
+                const char* end = cursor + 1;
+                while (*end != '\0' && *end != '%' && *end != '\\') end++;
+                if (*end == '\\' && end == cursor + 1) end++;
+                char* piece = arenaStrndup(&commandArena, cursor, end - cursor);
+                if (printEscaped(piece, 0)){
+                    return (fflush(stdout) == EOF) ? 1 : status;
+                }
+                cursor = end - 1;
+                continue;
+            }
+            if (*cursor != '%'){
+                putchar(*cursor);
+                continue;
+            }
+            if (cursor[1] == '%'){
+                putchar('%');
+                cursor++;
+                continue;
+            }
+
+            // Copy the flags, width and precision into spec and add the length modifier the argument is passed with
+            size_t specLength = strspn(cursor + 1, "-+ #0123456789.") + 1;
+            if (specLength > sizeof(spec) - 4){
+                return BUILTIN_FALLBACK;
+            }
+            memcpy(spec, cursor, specLength);
+            char conversion = cursor[specLength];
+            const char* arg = (*args != NULL) ? *args++ : NULL;
+            cursor += specLength;
+
+            if (conversion == 's' || conversion == 'c'){
+                spec[specLength] = 's';
+                spec[specLength + 1] = '\0';
+                const char* text = (arg != NULL) ? arg : "";
+                if (conversion == 'c'){
+                    text = arenaStrndup(&commandArena, text, (text[0] != '\0') ? 1 : 0);
+                }
+                printf(spec, text);
+                continue;
+            }
+
+            // Numbers, a leading quote gives the value of the character after it
+            if (strchr("eEfFgGaA", conversion) != NULL){
+                long double value = 0;
+                char* end = NULL;
+                if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')){
+                    value = (unsigned char)arg[1];
+                }
+                else if (arg != NULL){
+                    value = strtold(arg, &end);
+                    if (end == arg || *end != '\0'){
+                        fflush(stdout); // Keep the error after the output already formatted
+                        fprintf(stderr, "printf: %s: invalid number\n", arg);
+                        status = 1;
+                    }
+                }
+                spec[specLength] = 'L';
+                spec[specLength + 1] = conversion;
+                spec[specLength + 2] = '\0';
+                printf(spec, value);
+            }
+            else {
+                long long value = 0;
+                char* end = NULL;
+                if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')){
+                    value = (unsigned char)arg[1];
+                }
+                else if (arg != NULL){
+                    errno = 0;
+                    value = (strchr("di", conversion) != NULL || arg[0] == '-') ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+                    if (end == arg || *end != '\0' || errno != 0){
+                        fflush(stdout); // Keep the error after the output already formatted
+                        fprintf(stderr, "printf: %s: invalid number\n", arg);
+                        status = 1;
+                    }
+                }
+                spec[specLength] = 'l';
+                spec[specLength + 1] = 'l';
+                spec[specLength + 2] = conversion;
+                spec[specLength + 3] = '\0';
+                printf(spec, value);
+            }
+        }
+        // The format is only reused if it consumed arguments, otherwise extra arguments would loop forever
+        if (args == passStart) break;
+    } while (*args != NULL);
+    return (fflush(stdout) == EOF) ? 1 : status;
+}
+
+#define COPY_CHUNK (8 << 20) // Most bytes asked of one copy_file_range, sendfile or splice call, ^C is checked between them
+#define COPY_BUFFER_SIZE (1 << 20)
+
+/* Returns 1 and sets errno to EINTR once ^C has been pressed, copies in the shell don't go through the event loop so a */
+/* pending SIGINT is taken here, SIGTSTP and SIGCHLD stay queued on signalFD until the copy is over */
+int copyInterrupted(){
+    sigset_t interruptSet;
+    struct timespec noWait = {0, 0};
+    sigemptyset(&interruptSet);
+    sigaddset(&interruptSet, SIGINT);
+    if (sigtimedwait(&interruptSet, NULL, &noWait) == SIGINT){
+        interrupted = 1;
+    }
+    if (interrupted){
+        errno = EINTR;
+    }
+    return interrupted;
+}
+
+/* Copies everything left in inFD to outFD inside the kernel where it can, returns 0 or -1 with errno set */
+/* Regular files go through copy_file_range (which can share extents or copy on the server), then sendfile, which takes */
+/* any kind of output, and a pipe is spliced, the calls use and move the files' own offsets so whenever one isn't */
+/* supported for this pair of files the next carries on from where it stopped, with a read/write loop as the last resort */
+/* The copy stops early, returning -1 with errno set to EINTR, when ^C is pressed */
+int copyFile(int inFD, int outFD){
+    static char* buffer;
+    struct stat inInfo, outInfo;
+    ssize_t copied;
+    if (fstat(inFD, &inInfo) == -1 || fstat(outFD, &outInfo) == -1){
+        return -1;
+    }
+    if (S_ISREG(inInfo.st_mode) && S_ISREG(outInfo.st_mode)){
+        while (!copyInterrupted() && (copied = copy_file_range(inFD, NULL, outFD, NULL, COPY_CHUNK, 0)) > 0){}
+        if (interrupted) return -1;
+        if (copied == 0) return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) return -1;
+    }
+    if (S_ISREG(inInfo.st_mode)){
+        while (!copyInterrupted() && (copied = sendfile(outFD, inFD, NULL, COPY_CHUNK)) > 0){}
+        if (interrupted) return -1;
+        if (copied == 0) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+    }
+    else if (S_ISFIFO(inInfo.st_mode)){
+        while (!copyInterrupted() && (copied = splice(inFD, NULL, outFD, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0){}
+        if (interrupted) return -1;
+        if (copied == 0) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+    }
+
+    if (buffer == NULL){
+        buffer = malloc(COPY_BUFFER_SIZE);
+    }
+    while ((copied = read(inFD, buffer, COPY_BUFFER_SIZE)) != 0){
+        if (copied == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ssize_t written = 0;
+        while (written < copied){
+            ssize_t result = write(outFD, buffer + written, copied - written);
+            if (result == -1){
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            written += result;
+        }
+        if (copyInterrupted()) return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 if a file is something the built in cat reads: a regular file, or for stdin a pipe that is already open */
+/* A named pipe would block the shell in open until a writer comes, so it is left to the external cat along with */
+/* terminals and devices, where ^C can stop them */
+int catReadable(struct stat* info, int isStdin){
+    return S_ISREG(info->st_mode) || (isStdin && S_ISFIFO(info->st_mode));
+}
+
+/* Built in cat, copies each file (or stdin for none or -) to stdout with copyFile, options are left to the external cat */
+/* Every input is checked before anything is copied so falling back never repeats output */
+int builtinCat(struct userCommand* currentCommand){
+    struct stat info, outInfo;
+    int i;
+    int outKnown = (fstat(STDOUT_FILENO, &outInfo) == 0);
+    for (i = 0; currentCommand->argument[i] != NULL; i++){
+        const char* file = currentCommand->argument[i];
+        if (file[0] == '-' && file[1] != '\0'){
+            return BUILTIN_FALLBACK;
+        }
+        int isStdin = (strcmp(file, "-") == 0);
+        int exists = isStdin ? fstat(STDIN_FILENO, &info) == 0 : stat(file, &info) == 0;
+        if (exists && !catReadable(&info, isStdin)){
+            return BUILTIN_FALLBACK;
+        }
+    }
+    if (currentCommand->argument[0] == NULL && (fstat(STDIN_FILENO, &info) == -1 || !catReadable(&info, 1))){
+        return BUILTIN_FALLBACK;
+    }
+
+    int status = 0;
+    i = 0;
+    do {
+        const char* file = currentCommand->argument[i];
+        int fromStdin = (file == NULL || strcmp(file, "-") == 0);
+        int inFD = fromStdin ? STDIN_FILENO : open(file, O_RDONLY | O_CLOEXEC);
+        if (inFD == -1){
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            status = 1;
+            continue;
+        }
+        // Copying a regular file onto itself would never end
+        if (outKnown && fstat(inFD, &info) == 0 && S_ISREG(info.st_mode) && info.st_dev == outInfo.st_dev && info.st_ino == outInfo.st_ino){
+            fprintf(stderr, "cat: %s: input file is output file\n", fromStdin ? "-" : file);
+            status = 1;
+        }
+        else if (copyFile(inFD, STDOUT_FILENO) == -1){
+            if (!interrupted){
+                fprintf(stderr, "cat: %s: %s\n", fromStdin ? "-" : file, strerror(errno));
+            }
+            status = 1;
+        }
+        if (!fromStdin){
+            close(inFD);
+        }
+    } while (!interrupted && currentCommand->argument[i] != NULL && currentCommand->argument[++i] != NULL);
+
+    // ^C stops cat like it would the external one
+    return interrupted ? 128 + SIGINT : status;
+}
+
+/* Built in cp for a single regular file, "cp SOURCE TARGET" where TARGET may be a directory to copy into */
+/* The data is moved with copyFile, options and anything else are left to the external cp */
+int builtinCp(struct userCommand* currentCommand){
+    struct stat sourceInfo, targetInfo;
+    if (currentCommand->argumentCount != 2 || currentCommand->argument[0][0] == '-' || currentCommand->argument[1][0] == '-'){
+        return BUILTIN_FALLBACK;
+    }
+    const char* source = currentCommand->argument[0];
+    const char* target = currentCommand->argument[1];
+    if (stat(source, &sourceInfo) == -1 || !S_ISREG(sourceInfo.st_mode)){
+        return BUILTIN_FALLBACK;
+    }
+
+    // Copying into a directory keeps the file's name
+    char path[PATH_MAX];
+    if (stat(target, &targetInfo) == 0 && S_ISDIR(targetInfo.st_mode)){
+        const char* name = strrchr(source, '/');
+        name = (name == NULL) ? source : name + 1;
+        if (snprintf(path, sizeof(path), "%s/%s", target, name) >= (int)sizeof(path)){
+            return BUILTIN_FALLBACK;
+        }
+        target = path;
+    }
+    if (stat(target, &targetInfo) == 0 && targetInfo.st_dev == sourceInfo.st_dev && targetInfo.st_ino == sourceInfo.st_ino){
+        fprintf(stderr, "cp: %s and %s are the same file\n", source, target);
+        return 1;
+    }
+
+    int inFD = open(source, O_RDONLY | O_CLOEXEC);
+    if (inFD == -1){
+        fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+    int outFD = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sourceInfo.st_mode & 0777);
+    if (outFD == -1){
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        close(inFD);
+        return 1;
+    }
+    int status = 0;
+    if (copyFile(inFD, outFD) == -1){
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        status = 1;
+    }
+    close(inFD);
+    if (close(outFD) == -1 && status == 0){
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+/* Handles redirecting input/output for commands which require it, adds the redirections as file actions for spawnCommand */
+/* Files are opened here in the shell so an error can be reported before anything is launched, returns -1 if a file can't be opened */
+/* Referenced Exploration: Processes and I/O in course modules */
+int redirectIO(struct userCommand* currentCommand, posix_spawn_file_actions_t* actions, int* sourceFD, int* targetFD){
+
+    // Handle input redirection
+    if (currentCommand->inputFile != NULL){
+        // Open source file (close on exec so only the dup2'd copy reaches the child)
+        *sourceFD = open(currentCommand->inputFile, O_RDONLY | O_CLOEXEC);
+        // If file can't be opened, print error and let caller set exit status to 1
+        if (*sourceFD == -1) { 
+            printf("cannot open %s file for input\n", currentCommand->inputFile);
+            fflush(stdout);
+            return -1; 
+        }
+
+        // Redirect stdin to source file in the child
+        posix_spawn_file_actions_adddup2(actions, *sourceFD, 0);
+    }
+
+    // Handle output redirection
+    if (currentCommand->outputFile != NULL){
+        // Open target file
+        *targetFD = open(currentCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        // If file can't be opened, print error and let caller set exit status to 1
+        if (*targetFD == -1) { 
+            printf("cannot open %s file for output\n", currentCommand->outputFile);
+            fflush(stdout);
+            return -1; 
+        }
+        
+        // Redirect stdout to target file in the child
+        posix_spawn_file_actions_adddup2(actions, *targetFD, 1);
+    }
+    return 0;
+}
+
+/* Handles redirecting input to dev/null/ for background commands */
+/* Referenced Exploration: Processes and I/O in course modules */
+void redirectItoDEV(posix_spawn_file_actions_t* actions){
+
+    // Set input redirection to dev/null/, opened by the child directly onto stdin
+    posix_spawn_file_actions_addopen(actions, 0, "/dev/null", O_RDONLY, 0);
+}
+
+/* Handles redirecting output to dev/null/ for background commands */
+/* Referenced Exploration: Processes and I/O in course modules */
+void redirectOtoDEV(posix_spawn_file_actions_t* actions){
+
+    // Set output redirection to dev/null/, opened by the child directly onto stdout
+    posix_spawn_file_actions_addopen(actions, 1, "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+/* Picks the CPU for the next background process in round robin mode, from jobCPUs or else the CPUs the shell may use */
+int pickJobCPU(){
+    cpu_set_t allowed;
+    if (jobCPUCount != 0){
+        allowed = jobCPUs;
+    }
+    else if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1){
+        return -1;
+    }
+    int i;
+    for (i = 0; i < CPU_SETSIZE; i++){
+        int cpu = (nextJobCPU + i) % CPU_SETSIZE;
+        if (CPU_ISSET(cpu, &allowed)){
+            nextJobCPU = cpu + 1;
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Returns the CPUs the next background job is pinned to with jobopt -c, single is filled in for auto and any, NULL if */
+/* jobs aren't pinned */
+cpu_set_t* jobCPUSet(cpu_set_t* single){
+    if (jobCPURoundRobin){
+        int cpu = pickJobCPU();
+        if (cpu != -1){
+            CPU_ZERO(single);
+            CPU_SET(cpu, single);
+            return single;
+        }
+    }
+    return (jobCPUCount != 0) ? &jobCPUs : NULL;
+}
+
+/* Applies the jobopt affinity, nice value and resource limits to the calling process, a child about to exec */
+/* Returns 0, or the errno of the setting that failed */
+int applyJobOptions(cpu_set_t* cpus){
+    int i;
+    if ((cpus != NULL && sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1) ||
+        (jobNiceSet && setpriority(PRIO_PROCESS, 0, jobNice) == -1)){
+        return errno;
+    }
+    for (i = 0; i < jobLimitCount; i++){
+        struct rlimit limit = { jobLimits[i].value, jobLimits[i].value };
+        if (setrlimit(jobLimits[i].resource, &limit) == -1){
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/* Launches a background process with the jobopt options applied in the child between vfork and exec, which posix_spawn */
+/* has no way to do, returns 0 and sets childPid or returns the error that stopped the launch like posix_spawn */
+/* inFD and outFD become the child's stdin and stdout, the child only makes system calls before it execs */
+int launchWithOptions(pid_t* childPid, const char* path, char** argv, char** envp, int inFD, int outFD, pid_t processGroup){
+    volatile int childError = 0; // Shared with the child until it execs
+    cpu_set_t single;
+    cpu_set_t* cpus = jobCPUSet(&single);
+    sigset_t childMask;
+    sigemptyset(&childMask);
+
+    pid_t spawnpid = vfork();
+    if (spawnpid == 0){
+        dup2(inFD, STDIN_FILENO);
+        dup2(outFD, STDOUT_FILENO);
+        if (processGroup != -1) setpgid(0, processGroup);
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        if ((childError = applyJobOptions(cpus)) != 0){
+            _exit(127);
+        }
+        execve(path, argv, envp);
+        childError = errno;
+        _exit(127);
+    }
+    if (spawnpid == -1){
+        return errno;
+    }
+    // The child has exec'd or exited by the time vfork returns, a failed child still has to be reaped
+    if (childError != 0){
+        while (waitpid(spawnpid, NULL, 0) == -1 && errno == EINTR){}
+        return childError;
+    }
+    *childPid = spawnpid;
+    return 0;
+}
+
+/* Returns 1 if file is a named pipe, opening one waits for a process at the other end */
+int isFIFO(const char* file){
+    struct stat info;
+    return file != NULL && stat(file, &info) == 0 && S_ISFIFO(info.st_mode);
+}
+
+/* Launches a command that redirects to or from a named pipe with a real fork, posix_spawn and vfork keep the shell */
+/* suspended until the child execs and the child may wait in open for as long as the other end takes, a background job */
+/* would hang the shell. The child opens the files itself and reports a file it can't open like the shell would, with */
+/* exit status 1, returns the pid of the child or -1 if it could not be launched */
+pid_t forkCommand(struct userCommand* currentCommand, int inBackground, int pipeIn, int pipeOut, pid_t processGroup){
+    const char* path = lookupCommand(currentCommand->argv[0], 1);
+    char** envp = shellEnvironment();
+    cpu_set_t single;
+    cpu_set_t* cpus = (inBackground && jobOptionsSet) ? jobCPUSet(&single) : NULL;
+    fflush(stdout);
+    pid_t spawnpid = (path == NULL) ? -1 : fork();
+    if (spawnpid == 0){
+        // Same setup as the spawn attributes, then the redirections, /dev/null for background jobs that have none
+        sigset_t childMask;
+        sigemptyset(&childMask);
+        if (processGroup != -1) setpgid(0, processGroup);
+        if (!inBackground) signal(SIGINT, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        int inFD = pipeIn, outFD = pipeOut;
+        if (currentCommand->inputFile != NULL && (inFD = open(currentCommand->inputFile, O_RDONLY | O_CLOEXEC)) == -1){
+            printf("cannot open %s file for input\n", currentCommand->inputFile);
+            fflush(stdout);
+            _exit(1);
+        }
+        if (currentCommand->outputFile != NULL &&
+            (outFD = open(currentCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1){
+            printf("cannot open %s file for output\n", currentCommand->outputFile);
+            fflush(stdout);
+            _exit(1);
+        }
+        if (inBackground && inFD == -1) inFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (inBackground && outFD == -1) outFD = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (inFD != -1) dup2(inFD, STDIN_FILENO);
+        if (outFD != -1) dup2(outFD, STDOUT_FILENO);
+        if (inBackground && jobOptionsSet && applyJobOptions(cpus) != 0){
+            _exit(127);
+        }
+        execve(path, currentCommand->argv, envp);
+        fprintf(stderr, "Command could not be executed...\n");
+        _exit(127);
+    }
+    if (spawnpid == -1){
+        printf("Command could not be executed...\n");
+        fflush(stdout);
+    }
+    // Set the group from both sides so the next stage of a pipeline can join it whichever runs first
+    else if (processGroup != -1){
+        setpgid(spawnpid, processGroup);
+    }
+    return spawnpid;
+}
+
+/* Launches a command with posix_spawn instead of fork, returns the pid of the child or -1 if it could not be launched */
+/* posix_spawn uses a vfork-style clone so the cost doesn't grow with the size of the shell, signal and IO setup are */
+/* described with spawn attributes and file actions rather than done by hand in a forked child */
+/* pipeIn/pipeOut are pipe ends to use as stdin/stdout (-1 for none), redirections given by the user take precedence */
+/* processGroup is the group to put the child in, 0 to start a new group and -1 to stay in the shell's group */
+pid_t spawnCommand(struct userCommand* currentCommand, int inBackground, int pipeIn, int pipeOut, pid_t processGroup){
+    char** argv = currentCommand->argv;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t defaultSignals, childMask;
+    int sourceFD = -1, targetFD = -1;
+    pid_t spawnpid = -1;
+
+    if (isFIFO(currentCommand->inputFile) || isFIFO(currentCommand->outputFile)){
+        return forkCommand(currentCommand, inBackground, pipeIn, pipeOut, processGroup);
+    }
+
+    // Check if process requires IO redirection- redirect IO if so
+    posix_spawn_file_actions_init(&actions);
+    if (pipeIn != -1){
+        posix_spawn_file_actions_adddup2(&actions, pipeIn, 0);
+    }
+    if (pipeOut != -1){
+        posix_spawn_file_actions_adddup2(&actions, pipeOut, 1);
+    }
+    if (redirectIO(currentCommand, &actions, &sourceFD, &targetFD) == -1){
+        if (sourceFD != -1) close(sourceFD);
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    if (inBackground){
+        // If user doesn't redirect standard input/output for a background command, redirect it to /dev/null
+        if (currentCommand->inputFile == NULL && pipeIn == -1){
+            redirectItoDEV(&actions);
+        }
+        if (currentCommand->outputFile == NULL && pipeOut == -1){
+            redirectOtoDEV(&actions);
+        }
+    }
+
+    // Foreground children get the default SIGINT action back, background children keep ignoring it like the shell does
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&defaultSignals);
+    if (!inBackground){
+        sigaddset(&defaultSignals, SIGINT);
+    }
+    sigemptyset(&childMask);
+    posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+    posix_spawnattr_setsigmask(&attributes, &childMask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (processGroup != -1){
+        posix_spawnattr_setpgroup(&attributes, processGroup);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    // Children inherit the shell's ignored SIGTSTP, the mask is cleared since the shell blocks the signals it reads from signalFD
+
+    // Background processes with jobopt options are launched by launchWithOptions instead, its stdin and stdout are
+    // worked out the same way as the file actions
+    int result = ENOENT;
+    int withOptions = (inBackground && jobOptionsSet);
+    int inFD = STDIN_FILENO, outFD = STDOUT_FILENO, nullFD = -1;
+    if (withOptions){
+        inFD = (sourceFD != -1) ? sourceFD : pipeIn;
+        outFD = (targetFD != -1) ? targetFD : pipeOut;
+        if (inFD == -1 || outFD == -1){
+            nullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+            if (inFD == -1) inFD = nullFD;
+            if (outFD == -1) outFD = nullFD;
+        }
+    }
+
+    // Resolve the command through the hash table so the launch is a single execve, if a hashed path has disappeared
+    // since it was cached forget it and search PATH once more
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++){
+        const char* path = lookupCommand(argv[0], 1);
+        if (path == NULL){
+            break;
+        }
+        if (withOptions){
+            result = launchWithOptions(&spawnpid, path, argv, shellEnvironment(), inFD, outFD, processGroup);
+        }
+        else {
+            result = posix_spawn(&spawnpid, path, &actions, &attributes, argv, shellEnvironment());
+        }
+        if (result != ENOENT || path == argv[0]){
+            break;
+        }
+        forgetCommand(argv[0]);
+    }
+    if (nullFD != -1) close(nullFD);
+
+    // Shell's copies of the redirected files are no longer needed
+    if (sourceFD != -1) close(sourceFD);
+    if (targetFD != -1) close(targetFD);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    // If command could not be executed, print message to user
+    if (result != 0){
+        printf("Command could not be executed...\n");
+        fflush(stdout);
+        return -1;
+    }
+    return spawnpid;
+}
+
+/* Launches every stage of a pipeline at once, connected with pipes, and stores each stage's pid in stagePids */
+/* A stage that can't be launched gets -1, the stages around it see end of file or a broken pipe */
+/* Background pipelines get their own process group so the job can be signalled as a whole, foreground ones stay in */
+/* the shell's group so ^C from the terminal reaches every stage */
+/* outputFD is where the last stage's output goes instead of the shell's stdout, -1 for stdout */
+void launchPipeline(struct userCommand* currentCommand, int inBackground, pid_t* stagePids, int outputFD){
+    struct userCommand* stage;
+    int pipeIn = -1;
+    pid_t processGroup = inBackground ? 0 : -1;
+    int i = 0;
+
+    for (stage = currentCommand; stage != NULL; stage = stage->nextStage, i++){
+        int pipeEnds[2] = { -1, outputFD };
+        if (stage->nextStage != NULL){
+            if (pipe2(pipeEnds, O_CLOEXEC) == -1){
+                perror("pipe2()");
+            }
+#ifdef F_SETPIPE_SZ
+            else if (pipeBufferSize > 0){
+                fcntl(pipeEnds[1], F_SETPIPE_SZ, pipeBufferSize);
+            }
+#endif
+        }
+
+        stagePids[i] = spawnCommand(stage, inBackground, pipeIn, pipeEnds[1], processGroup);
+        if (processGroup == 0 && stagePids[i] != -1){
+            processGroup = stagePids[i]; // Later stages join the first stage's group
+        }
+
+        // Shell's copies of the pipe ends belong to the children now
+        if (pipeIn != -1) close(pipeIn);
+        if (pipeEnds[1] != -1 && pipeEnds[1] != outputFD) close(pipeEnds[1]);
+        pipeIn = pipeEnds[0];
+    }
+}
+
+/* Returns the number of stages in a pipeline */
+int countStages(struct userCommand* currentCommand){
+    int stages = 0;
+    for (; currentCommand != NULL; currentCommand = currentCommand->nextStage){
+        stages++;
+    }
+    return stages;
+}
+
+void waitForeground(struct userCommand* currentCommand, pid_t* stagePids, int stages, struct timespec* started);
+
+/* Handles commands that are not builtins and running in the foreground, for a pipeline the status is the last stage's */
+void handleExecCommand(struct userCommand* currentCommand){
+    // Creates child processes to handle the command
+    int stages = countStages(currentCommand);
+    pid_t* stagePids = arenaAlloc(&commandArena, stages * sizeof(pid_t));
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    launchPipeline(currentCommand, 0, stagePids, -1);
+    waitForeground(currentCommand, stagePids, stages, &started);
+}
+
+/* Waits for the stages of a foreground command launched at started, and sets the status from the last stage */
+void waitForeground(struct userCommand* currentCommand, pid_t* stagePids, int stages, struct timespec* started){
+    // waits for every stage to terminate, the SIGCHLD handler may interrupt the wait, and adds up what they used
+    int childExitMethod = -5;
+    struct jobStats stats = {0};
+    struct rusage usage;
+    int i;
+    for (i = 0; i < stages; i++){
+        if (stagePids[i] != -1){
+            while (wait4(stagePids[i], &childExitMethod, 0, &usage) == -1 && errno == EINTR){}
+            addUsage(&stats, &usage);
+        }
+    }
+    stats.wallSeconds = secondsSince(started);
+    if (stagePids[stages - 1] != -1 && (currentCommand->timed || accountingOn)){
+        char* commandLine = (accountingLog != NULL) ? describeCommand(currentCommand) : NULL;
+        accountJob(currentCommand->timed, stagePids[stages - 1], commandLine, childExitMethod, &stats);
+        free(commandLine);
+    }
+
+    // Something went wrong, last command could not be launched or redirected, set value of status command to 1
+    if (stagePids[stages - 1] == -1){
+        statusExit = 1;
+        exitTrue = 1;
+    }
+    // If terminated normally, set global status to the exit status
+    else if (WIFEXITED(childExitMethod)){
+        int exitStatus = WEXITSTATUS(childExitMethod);
+        statusExit = exitStatus;
+        exitTrue = 1;
+    }
+    // If terminated by signal, set global status to the terminating signal
+    else if (WIFSIGNALED(childExitMethod)) {
+        int termSignal = WTERMSIG(childExitMethod);
+        statusSignal = termSignal;
+        exitTrue = 0;
+    }
+}
+
+/* Handles commands that are not builtins and running in the background, adds the processes to the job table and returns */
+/* the pid reported for the job (the last stage of a pipeline), returns -1 if nothing could be launched */
+pid_t handleBackgroundCommand(struct userCommand* currentCommand){
+    // Creates child processes to handle the command
+    int stages = countStages(currentCommand);
+    pid_t* stagePids = arenaAlloc(&commandArena, stages * sizeof(pid_t));
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    launchPipeline(currentCommand, 1, stagePids, -1);
+
+    // The job is reported by its last stage that launched
+    int reported = -1;
+    int i;
+    for (i = 0; i < stages; i++){
+        if (stagePids[i] != -1){
+            reported = i;
+        }
+    }
+
+    // Something went wrong, command could not be launched or redirected, set value of status command to 1
+    if (reported == -1){
+        statusExit = 1;
+        exitTrue = 1;
+        return -1;
+    }
+
+    // Put pids of child processes into the job table so they are reaped when they terminate
+    int jobNumber = newJobNumber();
+    pid_t processGroup = -1;
+    for (i = 0; i < stages; i++){
+        if (stagePids[i] != -1){
+            if (processGroup == -1){
+                processGroup = stagePids[i];
+            }
+            struct job* newJob = addJob(stagePids[i], processGroup, jobNumber, (i == reported) ? describeCommand(currentCommand) : NULL);
+            newJob->timed = currentCommand->timed;
+            newJob->started = started;
+        }
+    }
+    activeJobs++;
+    lastBackgroundPid = stagePids[reported];
+    return stagePids[reported];
+}
+
+/* Returns a copy of a parsed command (every stage of a pipeline) allocated from the given arena */
+struct userCommand* copyCommand(struct arena* pool, struct userCommand* source){
+    struct userCommand* first = NULL;
+    struct userCommand** link = &first;
+    int i;
+    for (; source != NULL; source = source->nextStage){
+        struct userCommand* copy = arenaAlloc(pool, sizeof(struct userCommand));
+        *copy = *source;
+        copy->argv = arenaAlloc(pool, (source->argumentCount + 2) * sizeof(char*));
+        for (i = 0; source->argv[i] != NULL; i++){
+            copy->argv[i] = arenaStrndup(pool, source->argv[i], strlen(source->argv[i]));
+        }
+        copy->argv[i] = NULL;
+        copy->command = copy->argv[0];
+        copy->argument = copy->argv + 1;
+        if (source->inputFile != NULL){
+            copy->inputFile = arenaStrndup(pool, source->inputFile, strlen(source->inputFile));
+        }
+        if (source->outputFile != NULL){
+            copy->outputFile = arenaStrndup(pool, source->outputFile, strlen(source->outputFile));
+        }
+        copy->nextStage = NULL;
+        *link = copy;
+        link = &copy->nextStage;
+    }
+    return first;
+}
+
+/* Runs a background command now if the parallel -j cap allows it, otherwise queues a copy of it to start later */
+/* Returns the pid of the launched job, 0 if it was queued, or -1 if it could not be launched */
+pid_t scheduleBackgroundCommand(struct userCommand* currentCommand){
+    if (maxParallelJobs == 0 || (activeJobs < maxParallelJobs && jobQueueHead == NULL)){
+        return handleBackgroundCommand(currentCommand);
+    }
+
+    struct queuedJob* queued = malloc(sizeof(struct queuedJob));
+    queued->pool.head = NULL;
+    queued->command = copyCommand(&queued->pool, currentCommand);
+    queued->next = NULL;
+    if (jobQueueTail == NULL){
+        jobQueueHead = queued;
+    }
+    else {
+        jobQueueTail->next = queued;
+    }
+    jobQueueTail = queued;
+    queuedJobCount++;
+    return 0;
+}
+
+/* Starts queued background commands while there are free slots under the parallel -j cap */
+void startQueuedJobs(){
+    while (jobQueueHead != NULL && (maxParallelJobs == 0 || activeJobs < maxParallelJobs)){
+        struct queuedJob* queued = jobQueueHead;
+        jobQueueHead = queued->next;
+        if (jobQueueHead == NULL){
+            jobQueueTail = NULL;
+        }
+        queuedJobCount--;
+
+        pid_t backgroundPid = handleBackgroundCommand(queued->command);
+        if (backgroundPid != -1){
+            printf("background pid is %d\n", backgroundPid); // Print message to user with background pid
+            fflush(stdout);
+        }
+        arenaFree(&queued->pool);
+        free(queued);
+    }
+}
+
+/* Returns 1 if the character ends a word */
+int isWordEnd(char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\0' || c == '<' || c == '>' || c == '|' || c == ';';
+}
+
+/* Returns 1 if a command has to end at the cursor: only blanks are left before the end of the line, a ; or a reserved */
+/* word that ends a list (then, elif, else, fi, do or done), so a & just before it puts the command in the background */
+int atCommandEnd(const char* cursor){
+    static const char* listEnds[] = {"then", "elif", "else", "fi", "do", "done"};
+    while (*cursor == ' ' || *cursor == '\t'){
+        cursor++;
+    }
+    if (*cursor == '\0' || *cursor == '\n' || *cursor == ';'){
+        return 1;
+    }
+    int i;
+    for (i = 0; i < 6; i++){
+        size_t length = strlen(listEnds[i]);
+        if (strncmp(cursor, listEnds[i], length) == 0 && isWordEnd(cursor[length])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns how many characters the $ expansion at cursor takes up ($$, $?, $!, $NAME or ${NAME}), or 0 if the $ is */
+/* just a character */
+size_t dollarLength(const char* cursor){
+    size_t nameLength;
+    switch (cursor[1]){
+        case '$':
+        case '?':
+        case '!':
+            return 2;
+        case '{':
+            nameLength = variableNameLength(cursor + 2);
+            return (nameLength != 0 && cursor[2 + nameLength] == '}') ? nameLength + 3 : 0;
+        default:
+            nameLength = variableNameLength(cursor + 1);
+            return (nameLength != 0) ? nameLength + 1 : 0;
+    }
+}
+
+/* Returns the value of the $ expansion at cursor, which dollarLength has found to be one, and sets its length */
+/* Variables that aren't set expand to nothing */
+const char* expandDollar(const char* cursor, size_t* valueLength){
+    static char number[16];
+    const char* name = cursor + 1;
+    switch (cursor[1]){
+        case '$':
+            *valueLength = pidLength;
+            return pidString;
+        case '?':
+            *valueLength = snprintf(number, sizeof(number), "%d", lastStatus());
+            return number;
+        case '!':
+            *valueLength = (lastBackgroundPid == 0) ? 0 : snprintf(number, sizeof(number), "%d", lastBackgroundPid);
+            return number;
+        case '{':
+            name++;
+            break;
+    }
+    size_t nameLength = variableNameLength(name);
+    struct shellVariable* variable = findVariable(name, nameLength);
+    const char* value = (variable == NULL) ? "" : variable->entry + nameLength + 1;
+    *valueLength = strlen(value);
+    return value;
+}
+
+/* Returns the ) that closes the ( at open, or NULL if the line ends first */
+char* matchParenthesis(char* open){
+    int depth = 0;
+    char* cursor;
+    for (cursor = open; *cursor != '\0' && *cursor != '\n'; cursor++){
+        if (*cursor == '(') depth++;
+        else if (*cursor == ')' && --depth == 0) return cursor;
+    }
+    return NULL;
+}
+
+/* Scans the next token from the line in a single pass, returns its type and points text at the word for TOKEN_WORD */
+/* Words are NULL terminated in place in the input line, a $(...) is part of the word it is in even if it has blanks */
+/* or operators inside, expansions are left for the template to bind */
+int nextToken(struct lexer* lex, char** text){
+    char* cursor = lex->cursor;
+    char current = lex->pending;
+    lex->pending = 0;
+    if (current == 0){
+        while (*cursor == ' ' || *cursor == '\t'){
+            cursor++;
+        }
+        current = *cursor;
+    }
+
+    // Operators, & only means background when it is the last thing in a command
+    switch (current){
+        case '\0':
+            lex->cursor = cursor;
+            return TOKEN_END;
+        case '\n':
+            lex->cursor = cursor + 1;
+            return TOKEN_NEWLINE;
+        case ';':
+            lex->cursor = cursor + 1;
+            return TOKEN_SEPARATOR;
+        case '<':
+            lex->cursor = cursor + 1;
+            return TOKEN_INPUT;
+        case '>':
+            lex->cursor = cursor + 1;
+            return TOKEN_OUTPUT;
+        case '|':
+            if (cursor[1] == '|'){
+                lex->cursor = cursor + 2;
+                return TOKEN_OR;
+            }
+            lex->cursor = cursor + 1;
+            return TOKEN_PIPE;
+        case '&':
+            if (cursor[1] == '&'){
+                lex->cursor = cursor + 2;
+                return TOKEN_AND;
+            }
+            if (atCommandEnd(cursor + 1)){
+                lex->cursor = cursor + 1;
+                return TOKEN_BACKGROUND;
+            }
+            break;
+    }
+
+    char* start = cursor;
+    char* close;
+    while (!isWordEnd(*cursor)){
+        // && or a trailing & ends the word, the next call returns it as an operator
+        if (*cursor == '&' && (cursor[1] == '&' || atCommandEnd(cursor + 1))){
+            break;
+        }
+        if (cursor[0] == '$' && cursor[1] == '(' && (close = matchParenthesis(cursor + 1)) != NULL){
+            cursor = close + 1;
+            continue;
+        }
+        cursor++;
+    }
+
+    // Word is terminated in place, an operator (or newline) right after it is remembered
+    if (*cursor == ' ' || *cursor == '\t'){
+        *cursor++ = '\0';
+    }
+    else if (*cursor != '\0'){
+        lex->pending = *cursor;
+        *cursor = '\0';
+    }
+    lex->cursor = cursor;
+    *text = start;
+    return TOKEN_WORD;
+}
+
+/* Appends a segment of the given kind to a word's list of segments */
+struct wordSegment** addSegment(struct arena* pool, struct wordSegment** link, int kind, const char* text, size_t length){
+    struct wordSegment* segment = arenaAlloc(pool, sizeof(struct wordSegment));
+    segment->kind = kind;
+    segment->text = text;
+    segment->length = length;
+    segment->next = NULL;
+    *link = segment;
+    return &segment->next;
+}
+
+/* Breaks a word into literal text, $ expansions and $(...) substitutions, returns NULL if it has no expansions */
+/* $$ never changes so it is taken as literal text */
+struct wordSegment* findSegments(struct arena* pool, char* word, int* volatileSegments){
+    struct wordSegment* first = NULL;
+    struct wordSegment** link = &first;
+    char* literal = word;
+    char* cursor = word;
+    char* close;
+    size_t consumed;
+    *volatileSegments = 0;
+    while ((cursor = strchr(cursor, '$')) != NULL){
+        if (cursor[1] == '(' && (close = matchParenthesis(cursor + 1)) != NULL){
+            link = addSegment(pool, link, SEGMENT_LITERAL, literal, cursor - literal);
+            link = addSegment(pool, link, SEGMENT_SUBSTITUTION, cursor + 2, close - cursor - 2);
+            *volatileSegments = 1;
+            cursor = literal = close + 1;
+        }
+        else if ((consumed = dollarLength(cursor)) != 0){
+            link = addSegment(pool, link, SEGMENT_LITERAL, literal, cursor - literal);
+            if (cursor[1] == '$'){
+                link = addSegment(pool, link, SEGMENT_LITERAL, pidString, pidLength);
+            }
+            else {
+                link = addSegment(pool, link, SEGMENT_EXPANSION, cursor, consumed);
+                *volatileSegments = 1;
+            }
+            cursor = literal = cursor + consumed;
+        }
+        else {
+            cursor++;
+        }
+    }
+    if (first != NULL){
+        addSegment(pool, link, SEGMENT_LITERAL, literal, strlen(literal));
+    }
+    return first;
+}
+
+char* captureOutput(char* commandLine, size_t* length); // Defined below, after the functions that run commands
+
+/* Puts a word back together from its segments in memory from pool, running any $(...) in it, split is set if it had */
+/* one so its fields can be separated */
+char* bindWord(struct arena* pool, struct wordSegment* segment, int* split){
+    size_t capacity = 64, used = 0;
+    char* buffer = arenaAlloc(pool, capacity);
+    for (; segment != NULL; segment = segment->next){
+        const char* value = segment->text;
+        size_t valueLength = segment->length;
+        char* captured = NULL;
+        if (segment->kind == SEGMENT_EXPANSION){
+            value = expandDollar(segment->text, &valueLength);
+        }
+        else if (segment->kind == SEGMENT_SUBSTITUTION){
+            // The command is parsed from a copy since tokenizing changes the line
+            value = captured = captureOutput(arenaStrndup(&commandArena, segment->text, segment->length), &valueLength);
+            *split = 1;
+        }
+
+        // Grow the buffer to at least twice its size when a value doesn't fit
+        if (used + valueLength + 1 > capacity){
+            size_t grownCapacity = (used + valueLength + 1 > capacity * 2) ? used + valueLength + 1 : capacity * 2;
+            char* grown = arenaAlloc(pool, grownCapacity);
+            memcpy(grown, buffer, used);
+            buffer = grown;
+            capacity = grownCapacity;
+        }
+        memcpy(buffer + used, value, valueLength);
+        used += valueLength;
+        free(captured);
+    }
+    buffer[used] = '\0';
+    return buffer;
+}
+
+/* Tokenizes a line into a template allocated from pool, the line is changed in place and has to live as long as the */
+/* template, words that only have literal text and $$ in them are put together here once */
+struct commandTemplate* buildTemplate(struct arena* pool, char* line){
+    struct lexer lex = { line, 0 };
+    struct commandTemplate* template = arenaAlloc(pool, sizeof(struct commandTemplate));
+    int capacity = 16;
+    template->tokens = arenaAlloc(pool, capacity * sizeof(struct templateToken));
+    template->count = 0;
+    char* text;
+    int type;
+    do {
+        type = nextToken(&lex, &text);
+        if (template->count == capacity){
+            struct templateToken* grown = arenaAlloc(pool, capacity * 2 * sizeof(struct templateToken));
+            memcpy(grown, template->tokens, capacity * sizeof(struct templateToken));
+            template->tokens = grown;
+            capacity *= 2;
+        }
+        struct templateToken* token = &template->tokens[template->count++];
+        token->type = type;
+        token->text = NULL;
+        token->segments = NULL;
+        if (type == TOKEN_WORD){
+            int volatileSegments, split;
+            token->segments = findSegments(pool, text, &volatileSegments);
+            if (token->segments == NULL){
+                token->text = text;
+            }
+            else if (!volatileSegments){
+                token->text = bindWord(pool, token->segments, &split);
+                token->segments = NULL;
+            }
+        }
+    } while (type != TOKEN_END);
+    return template;
+}
+
+/* Returns how a token is shown in a syntax error */
+const char* tokenName(struct templateToken* token){
+    static const char* operators[] = { NULL, "<", ">", "|", "&", ";", "newline", "&&", "||", "newline" };
+    if (token->type != TOKEN_WORD){
+        return operators[token->type];
+    }
+    return (token->text != NULL) ? token->text : "word";
+}
+
+/* Appends a word to the list, doubling the array in the command arena when it is full */
+void addWord(struct wordList* list, char* word){
+    if (list->count == list->capacity){
+        list->capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        char** grown = arenaAlloc(&commandArena, list->capacity * sizeof(char*));
+        memcpy(grown, list->words, list->count * sizeof(char*));
+        list->words = grown;
+    }
+    list->words[list->count++] = word;
+}
+
+int compareNames(const void* left, const void* right){
+    return strcmp(*(char* const*)left, *(char* const*)right);
+}
+
+/* Reads a directory into the listing, replacing what it held, the names are sorted so glob results come out in order */
+int readListing(struct dirListing* listing){
+    DIR* directory = opendir(listing->path);
+    if (directory == NULL){
+        return -1;
+    }
+    size_t dataSize = 0, dataCapacity = 4096;
+    char* data = malloc(dataCapacity);
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL){
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+            continue;
+        }
+        size_t length = strlen(entry->d_name) + 1;
+        if (dataSize + length > dataCapacity){
+            dataCapacity *= 2;
+            data = realloc(data, dataCapacity);
+        }
+        memcpy(data + dataSize, entry->d_name, length);
+        dataSize += length;
+        count++;
+    }
+    closedir(directory);
+
+    // Names are pointed at only once data has stopped moving
+    free(listing->names);
+    free(listing->nameData);
+    listing->nameData = data;
+    listing->names = malloc((count + 1) * sizeof(char*));
+    listing->count = count;
+    char* name = data;
+    int i;
+    for (i = 0; i < count; i++){
+        listing->names[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(listing->names, count, sizeof(char*), compareNames);
+    return 0;
+}
+
+/* Drops a listing from the directory cache */
+void freeListing(struct dirListing* listing){
+    struct dirListing** link = &dirCache[hashString(listing->path) % DIR_CACHE_BUCKETS];
+    while (*link != listing){
+        link = &(*link)->next;
+    }
+    *link = listing->next;
+    free(listing->path);
+    free(listing->names);
+    free(listing->nameData);
+    free(listing);
+    dirCacheCount--;
+}
+
+/* Returns the listing of a directory for globbing, or NULL if it isn't a directory that can be read */
+/* A cached listing costs a stat, the directory is only read again when its mtime or identity has changed */
+struct dirListing* getListing(const char* path){
+    struct stat info;
+    if (stat(path, &info) == -1 || !S_ISDIR(info.st_mode)){
+        return NULL;
+    }
+    unsigned int bucket = hashString(path) % DIR_CACHE_BUCKETS;
+    struct dirListing* listing;
+    for (listing = dirCache[bucket]; listing != NULL; listing = listing->next){
+        if (strcmp(listing->path, path) == 0){
+            break;
+        }
+    }
+    if (listing != NULL){
+        listing->lastUsed = ++dirCacheClock;
+    }
+    if (listing != NULL && listing->device == info.st_dev && listing->inode == info.st_ino &&
+        listing->modified.tv_sec == info.st_mtim.tv_sec && listing->modified.tv_nsec == info.st_mtim.tv_nsec &&
+        listing->readAt - info.st_mtim.tv_sec >= DIR_RACY_SECONDS){
+        return listing;
+    }
+
+    // Not cached yet, make room by evicting the listing used longest ago, listings a glob is still walking through are
+    // skipped, if they are all pinned the cache goes over its limit until the next listing is added
+    if (listing == NULL){
+        if (dirCacheCount >= DIR_CACHE_LIMIT){
+            struct dirListing* oldest = NULL;
+            struct dirListing* candidate;
+            int i;
+            for (i = 0; i < DIR_CACHE_BUCKETS; i++){
+                for (candidate = dirCache[i]; candidate != NULL; candidate = candidate->next){
+                    if (candidate->pinned == 0 && (oldest == NULL || candidate->lastUsed < oldest->lastUsed)){
+                        oldest = candidate;
+                    }
+                }
+            }
+            if (oldest != NULL){
+                freeListing(oldest);
+            }
+        }
+        listing = calloc(1, sizeof(struct dirListing));
+        listing->path = strdup(path);
+        listing->lastUsed = ++dirCacheClock;
+        listing->next = dirCache[bucket];
+        dirCache[bucket] = listing;
+        dirCacheCount++;
+    }
+
+    // The stat is taken before reading, so anything changed while reading shows up as a new mtime next time
+    listing->device = info.st_dev;
+    listing->inode = info.st_ino;
+    listing->modified = info.st_mtim;
+    listing->readAt = time(NULL);
+    if (readListing(listing) == -1){
+        freeListing(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+/* Returns 1 if a word has glob characters, a [ only counts when a ] follows it so test's [ is left alone */
+int isGlobPattern(const char* word){
+    const char* bracket;
+    return strpbrk(word, "*?") != NULL || ((bracket = strchr(word, '[')) != NULL && strchr(bracket + 1, ']') != NULL);
+}
+
+/* Adds the paths matching pattern to the list, path holds the pathLength bytes already matched */
+/* Patterns are matched a component at a time against cached listings, verify is set when the path has been extended */
+/* with something that didn't come from a listing (a literal component or a slash) so it still has to be checked */
+void globMatch(char* path, size_t pathLength, const char* pattern, int verify, struct wordList* list){
+    while (*pattern == '/'){
+        if (pathLength + 1 >= PATH_MAX) return;
+        path[pathLength++] = '/';
+        pattern++;
+        verify = 1;
+    }
+    path[pathLength] = '\0';
+    if (*pattern == '\0'){
+        struct stat info;
+        if (!verify || lstat(path, &info) == 0){
+            addWord(list, arenaStrndup(&commandArena, path, pathLength));
+        }
+        return;
+    }
+
+    const char* end = strchrnul(pattern, '/');
+    size_t componentLength = end - pattern;
+    char component[NAME_MAX + 1];
+    if (componentLength > NAME_MAX){
+        return;
+    }
+    memcpy(component, pattern, componentLength);
+    component[componentLength] = '\0';
+
+    // A component without glob characters is taken as is
+    if (!isGlobPattern(component)){
+        if (pathLength + componentLength >= PATH_MAX) return;
+        memcpy(path + pathLength, component, componentLength);
+        globMatch(path, pathLength + componentLength, end, 1, list);
+        return;
+    }
+
+    struct dirListing* listing = getListing((pathLength == 0) ? "." : path);
+    if (listing == NULL){
+        return;
+    }
+    // Matching the rest of the pattern reads the subdirectories, which mustn't evict this listing
+    int i;
+    listing->pinned++;
+    for (i = 0; i < listing->count; i++){
+        // Leading dots have to be matched explicitly, like other shells
+        if (fnmatch(component, listing->names[i], FNM_PERIOD) == 0){
+            size_t nameLength = strlen(listing->names[i]);
+            if (pathLength + nameLength >= PATH_MAX) continue;
+            memcpy(path + pathLength, listing->names[i], nameLength);
+            globMatch(path, pathLength + nameLength, end, 0, list);
+        }
+    }
+    listing->pinned--;
+}
+
+/* Adds a word to the list, replaced by the sorted paths it matches if it is a glob pattern that matches anything */
+void expandWord(struct wordList* list, char* word){
+    if (!isGlobPattern(word)){
+        addWord(list, word);
+        return;
+    }
+    char path[PATH_MAX];
+    int before = list->count;
+    globMatch(path, 0, word, 0, list);
+    if (list->count == before){
+        addWord(list, word);
+    }
+}
+
+/* Adds the fields of a word holding $(...) output to the list, split at blanks and newlines, a word that is all blanks */
+/* adds nothing */
+void splitWord(struct wordList* list, char* word){
+    char* field = word;
+    while (1){
+        field += strspn(field, " \t\n");
+        if (*field == '\0'){
+            return;
+        }
+        char* end = field + strcspn(field, " \t\n");
+        int last = (*end == '\0');
+        *end = '\0';
+        expandWord(list, field);
+        if (last){
+            return;
+        }
+        field = end + 1;
+    }
+}
+
+/* Fills in argv for one command from the words collected for it, returns -1 if there were no words */
+/* A leading time prefix on the first stage only marks the command to have its resource use reported */
+int finishCommand(struct userCommand* currCommand, char** words, int word_count, int firstStage){
+    if (firstStage && word_count > 1 && strcmp(words[0], "time") == 0){
+        currCommand->timed = 1;
+        words++;
+        word_count--;
+    }
+    if (word_count == 0){
+        return -1;
+    }
 
-/* Initialize empty structs for signal handling */
-struct sigaction SIGINT_action = {0}, SIGTSTP_action = {0}, ignore_action = {0}, default_action = {0};
-
-// Handler for SIGTSTP, sets global variable foregroundOnly mode accordingly
-void handle_SIGTSTP(int signo){
-    if (foregroundOnlyMode == 0){
-        // Switch to foreground only mode
-        foregroundOnlyMode = 1;
-        waitpid(processes[numberOfProcesses-1], -5, 0); // waits for current foreground process to terminate
-        char* message = "Entering foreground-only mode (& is now ignored)\n";
-        write(STDOUT_FILENO, message, 48);
-        fflush(stdout);
+    // Copy the words into an argv sized for exactly the arguments given
+    currCommand->argv = arenaAlloc(&commandArena, (word_count + 1) * sizeof(char*));
+    memcpy(currCommand->argv, words, word_count * sizeof(char*));
+    currCommand->argv[word_count] = NULL;
+    currCommand->command = currCommand->argv[0];
+    currCommand->argument = currCommand->argv + 1;
+    currCommand->argumentCount = word_count - 1;
+    return 0;
+}
+
+/* Builds the command struct for a line from its template, returns pointer to that struct or NULL if the line has no command */
+/* or a syntax error was reported, which sets bindFailed */
+/* A pipeline is returned as its first command, with each stage linked to the next through nextStage */
+/* The structs, any expanded words and argv are all allocated from commandArena, so they are freed by resetting the arena */
+struct userCommand* bindTemplate(struct commandTemplate* template){
+    struct userCommand *firstCommand = arenaAlloc(&commandArena, sizeof(struct userCommand));
+    memset(firstCommand, 0, sizeof(struct userCommand));
+    struct userCommand *currCommand = firstCommand;
+
+    firstCommand->toBackground = 0; // Set toBackground value to False as default behavior
+    bindFailed = 0;
+
+    // Collect the words into a scratch array that doubles as needed, it is reused for each stage of a pipeline
+    struct wordList list = {0};
+    int assigning = 1; // Boolean, every word of this stage so far has been an assignment
+    struct templateToken* token;
+    struct templateToken* end = template->tokens + template->count;
+    char* text;
+
+    // Get command and arguments data and put redirections into struct attributes
+    for (token = template->tokens; token != end && token->type != TOKEN_END; token++){
+        if (token->type == TOKEN_WORD){ // Argument- glob patterns are replaced by the paths they match
+            int split = 0;
+            text = (token->text != NULL) ? token->text : bindWord(&commandArena, token->segments, &split);
+            // Assignments at the start of a command keep $(...) output whole, like other shells
+            int assignment = assigning && isAssignment(text);
+            assigning = assignment;
+            if (split && !assignment){
+                splitWord(&list, text);
+            }
+            else {
+                expandWord(&list, text);
+            }
+        }
+        else if (token->type == TOKEN_INPUT || token->type == TOKEN_OUTPUT){ // Input/output redirection- get filename and put it into struct attribute
+            // The token after a command is still in the line's template, it is what ended the command
+            if (token + 1 == end || token[1].type != TOKEN_WORD){
+                printf("syntax error near %s\n", tokenName(&token[1]));
+                fflush(stdout);
+                bindFailed = 1;
+                return NULL;
+            }
+            int split = 0;
+            text = (token[1].text != NULL) ? token[1].text : bindWord(&commandArena, token[1].segments, &split);
+            if (token->type == TOKEN_INPUT){
+                currCommand->inputFile = text;
+            }
+            else {
+                currCommand->outputFile = text;
+            }
+            token++;
+        }
+        else if (token->type == TOKEN_PIPE){ // Pipe- finish this stage and start the one its output goes to
+            if (finishCommand(currCommand, list.words, list.count, currCommand == firstCommand) == -1){
+                printf("syntax error near |\n");
+                fflush(stdout);
+                bindFailed = 1;
+                return NULL;
+            }
+            currCommand->nextStage = arenaAlloc(&commandArena, sizeof(struct userCommand));
+            currCommand = currCommand->nextStage;
+            memset(currCommand, 0, sizeof(struct userCommand));
+            list.count = 0;
+            assigning = 1;
+        }
+        else if (token->type == TOKEN_BACKGROUND){ // Last thing on the line so command (the whole pipeline) is to be executed in background
+            firstCommand->toBackground = 1;
+        }
     }
-    else {
-        // Switch out of foreground only mode
-        foregroundOnlyMode = 0;
-        waitpid(processes[numberOfProcesses-1], -5, 0); // waits for current foreground process to terminate
-        char* message = "Exiting foreground-only mode\n";
-	    write(STDOUT_FILENO, message, 28);
-        fflush(stdout);
+    if (finishCommand(currCommand, list.words, list.count, currCommand == firstCommand) == -1){
+        if (currCommand != firstCommand){
+            printf("syntax error near |\n");
+            fflush(stdout);
+            bindFailed = 1;
+        }
+        return NULL;
     }
+
+    // Print statement for debugging- prints all input given to as a command
+    // printf("COMMAND: %s, ARGS: %s, INPUT: %s, OUTPUT %s, BG: %d\n", firstCommand->command, firstCommand->argument[0], firstCommand->inputFile, firstCommand->outputFile, firstCommand->toBackground);
+    // fflush(stdout);
+    return firstCommand;
 }
 
-/* Receives a poitner to a string and replaces any instances of '$$' with the smallsh process id (done in place) */
-/* Referenced stackoverflow for this function */
-void replaceSubstring(char *target, const char *needle, const char *replacement)
+/* Parse the command given by user into the command struct, returns pointer to that struct or NULL if the line has no command */
+/* The line is tokenized in place and everything is allocated from commandArena */
+struct userCommand *createCommand(char *userInput)
 {
-    char buffer[1024] = { 0 };
-    char *insert_point = &buffer[0];
-    const char *tmp = target;
-    size_t needle_len = strlen(needle);
-    size_t repl_len = strlen(replacement);
+    return bindTemplate(buildTemplate(&commandArena, userInput));
+}
 
-    while (1) {
-        const char *p = strstr(tmp, needle);
+/* Returns a new node of the given type allocated from the parser's arena */
+struct commandNode* newNode(struct parser* parse, int type){
+    struct commandNode* node = arenaAlloc(parse->pool, sizeof(struct commandNode));
+    memset(node, 0, sizeof(struct commandNode));
+    node->type = type;
+    return node;
+}
 
-        if (p == NULL) {
-            strcpy(insert_point, tmp);
-            break;
-        }
+/* Returns 1 if the current token is the given reserved word, which is only looked for where a command starts */
+int atKeyword(struct parser* parse, const char* word){
+    struct templateToken* token = &parse->tokens[parse->position];
+    return token->type == TOKEN_WORD && token->text != NULL && strcmp(token->text, word) == 0;
+}
 
-        memcpy(insert_point, tmp, p - tmp);
-        insert_point += p - tmp;
-        memcpy(insert_point, replacement, repl_len);
-        insert_point += repl_len;
+/* Returns 1 if the current token is a reserved word that ends a list (then, elif, else, fi, do or done) */
+int atListEnd(struct parser* parse){
+    return atKeyword(parse, "then") || atKeyword(parse, "elif") || atKeyword(parse, "else") || atKeyword(parse, "fi") ||
+           atKeyword(parse, "do") || atKeyword(parse, "done");
+}
 
-        tmp = p + needle_len;
+/* Reports a syntax error at the current token, unless the tokens just ran out so the rest may be on the next line */
+void syntaxError(struct parser* parse){
+    struct templateToken* token = &parse->tokens[parse->position];
+    if (token->type == TOKEN_END){
+        parse->incomplete = 1;
+        return;
     }
-    strcpy(target, buffer);
+    printf("syntax error near %s\n", tokenName(token));
+    fflush(stdout);
+    parse->failed = 1;
 }
 
-/* Built in command to change directory, changes to HOME directory if no argument provided */
-void builtinCD(struct userCommand* currentCommand){
-    // Define home directory and current working directory
-    char* home = getenv("HOME");
-    char* cwd;
-    char buff[PATH_MAX + 1];
-    cwd = getcwd(buff, PATH_MAX + 1);
-    
-    // Given no arguments, change directory to HOME
-    if (currentCommand->argument[0] == NULL){
-        chdir(home);
+/* Skips over the reserved word that has to come next, returns 0 after reporting it missing */
+int expectKeyword(struct parser* parse, const char* word){
+    if (parse->failed || parse->incomplete){
+        return 0;
     }
-    // Given an argument, change directory according to argument (relative or absolute paths handled)
-    else {
-        char givenPath[PATH_MAX + 1];
-        strcpy(givenPath, currentCommand->argument[0]);
+    if (!atKeyword(parse, word)){
+        syntaxError(parse);
+        return 0;
+    }
+    parse->position++;
+    return 1;
+}
 
-        // Go to home
-        if (strcmp(givenPath, "~") == 0){
-            chdir(home);
-        }
-        // Go to path specified
-        else {
-            chdir(givenPath);  //cwd = getcwd(buff, PATH_MAX + 1);    printf("WHERE WE ARE: %s", cwd); (for debugging)
-        }
+/* Skips newlines, and ; as well if separators is set */
+void skipSeparators(struct parser* parse, int separators){
+    int type;
+    while ((type = parse->tokens[parse->position].type) == TOKEN_NEWLINE || (separators && type == TOKEN_SEPARATOR)){
+        parse->position++;
     }
 }
 
-/* Built in command to print out exit status or terminating signal of the last foreground process ran by shell */
-void builtinStatus(){
-    // If exitTrue Boolean, print out the last exit status, otherwise print out the last terminating signal
-    if (exitTrue){
-        printf("exit value %d\n", statusExit);
-        fflush(stdout);
+struct commandNode* parseList(struct parser* parse);
+
+/* Parses the condition or body of a block, which has to have at least one command */
+struct commandNode* parseBlockList(struct parser* parse){
+    struct commandNode* list = parseList(parse);
+    if (list == NULL && !parse->failed && !parse->incomplete){
+        syntaxError(parse);
     }
-    else{
-        printf("terminated by signal %d\n", statusSignal);
-        fflush(stdout);
+    return list;
+}
+
+/* Parses an if or elif through its fi, elif is parsed as another if in the else branch that shares the fi */
+struct commandNode* parseIf(struct parser* parse){
+    struct commandNode* node = newNode(parse, NODE_IF);
+    parse->position++;
+    node->condition = parseBlockList(parse);
+    if (!expectKeyword(parse, "then")){
+        return NULL;
+    }
+    node->body = parseBlockList(parse);
+    if (!parse->failed && atKeyword(parse, "elif")){
+        node->otherwise = parseIf(parse);
+        return (node->otherwise == NULL) ? NULL : node;
     }
+    if (!parse->failed && atKeyword(parse, "else")){
+        parse->position++;
+        node->otherwise = parseBlockList(parse);
+    }
+    return expectKeyword(parse, "fi") ? node : NULL;
 }
 
-/* Built in command to exit shell, kills any other processes or jobs started by the shell before terminating itself */
-void builtinExit(){
-    // Iterate over list of stored PIDS and kill all processes
-    int i;
-    for (i = 0; i < numberOfProcesses; i++){
-        kill(processes[i], SIGKILL);
-        // printf("KILLED PROCESS: %d\n", processes[i]); // FOR DEBUGGING PURPOSES
+/* Parses a while or until loop through its done */
+struct commandNode* parseWhile(struct parser* parse){
+    struct commandNode* node = newNode(parse, NODE_WHILE);
+    node->until = atKeyword(parse, "until");
+    parse->position++;
+    node->condition = parseBlockList(parse);
+    if (!expectKeyword(parse, "do")){
+        return NULL;
     }
-    exit(0); // Terminates calling process (smallsh)
+    node->body = parseBlockList(parse);
+    return expectKeyword(parse, "done") ? node : NULL;
 }
 
-/* Handles redirecting input/output for commands which require it, then passes along to handleExecCommand function */
-/* Referenced Exploration: Processes and I/O in course modules */
-void redirectIO(struct userCommand* currentCommand){
+/* Parses "for NAME in WORDS..." through its done, the words are kept as tokens and expanded each time the loop starts */
+struct commandNode* parseFor(struct parser* parse){
+    struct commandNode* node = newNode(parse, NODE_FOR);
+    parse->position++;
+    struct templateToken* token = &parse->tokens[parse->position];
+    if (token->type != TOKEN_WORD || token->text == NULL || variableNameLength(token->text) != strlen(token->text)){
+        syntaxError(parse);
+        return NULL;
+    }
+    node->variable = token->text;
+    parse->position++;
+    skipSeparators(parse, 0);
+    if (atKeyword(parse, "in")){
+        parse->position++;
+        node->words.tokens = &parse->tokens[parse->position];
+        while (parse->tokens[parse->position].type == TOKEN_WORD){
+            parse->position++;
+            node->words.count++;
+        }
+        int type = parse->tokens[parse->position].type;
+        if (type != TOKEN_SEPARATOR && type != TOKEN_NEWLINE){
+            syntaxError(parse);
+            return NULL;
+        }
+    }
+    skipSeparators(parse, 1);
+    if (!expectKeyword(parse, "do")){
+        return NULL;
+    }
+    node->body = parseBlockList(parse);
+    return expectKeyword(parse, "done") ? node : NULL;
+}
 
-    // Handle input redirection
-    if (currentCommand->inputFile != NULL){
-        // Open source file
-        int sourceFD = open(currentCommand->inputFile, O_RDONLY);
-        // If file can't be opened, print error and set exit status to 1
-        if (sourceFD == -1) { 
-            printf("cannot open %s file for input\n", currentCommand->inputFile);
-            fflush(stdout);
-            exit(1); 
+/* Parses one command, a block or a simple command (or pipeline) made of every token up to the next ;, &&, || or newline */
+/* or through a &, which ends the command as well as putting it in the background */
+struct commandNode* parseCommand(struct parser* parse){
+    int negate = 0;
+    if (atKeyword(parse, "!")){
+        negate = 1;
+        parse->position++;
+    }
+    struct commandNode* node;
+    if (atKeyword(parse, "if")){
+        node = parseIf(parse);
+    }
+    else if (atKeyword(parse, "while") || atKeyword(parse, "until")){
+        node = parseWhile(parse);
+    }
+    else if (atKeyword(parse, "for")){
+        node = parseFor(parse);
+    }
+    else {
+        node = newNode(parse, NODE_COMMAND);
+        node->words.tokens = &parse->tokens[parse->position];
+        int type;
+        while ((type = parse->tokens[parse->position].type) != TOKEN_SEPARATOR && type != TOKEN_NEWLINE &&
+               type != TOKEN_AND && type != TOKEN_OR && type != TOKEN_END){
+            parse->position++;
+            node->words.count++;
+            if (type == TOKEN_BACKGROUND){
+                break;
+            }
+        }
+        if (node->words.count == 0){
+            syntaxError(parse);
+            return NULL;
         }
+    }
+    if (node != NULL){
+        node->negate = negate;
+    }
+    return node;
+}
 
-        // Redirect stdin to source file
-        int result = dup2(sourceFD, 0);
-        if (result == -1) { 
-            perror("source dup2()"); 
-            exit(2); 
+/* Parses commands joined by && and ||, which group to the left */
+struct commandNode* parseAndOr(struct parser* parse){
+    struct commandNode* left = parseCommand(parse);
+    int type;
+    while (left != NULL && ((type = parse->tokens[parse->position].type) == TOKEN_AND || type == TOKEN_OR)){
+        struct commandNode* node = newNode(parse, (type == TOKEN_AND) ? NODE_AND : NODE_OR);
+        parse->position++;
+        skipSeparators(parse, 0);
+        node->condition = left;
+        node->body = parseCommand(parse);
+        if (node->body == NULL){
+            return NULL;
         }
+        left = node;
     }
+    return left;
+}
 
-    // Handle output redirection
-    if (currentCommand->outputFile != NULL){
-        // Open target file
-        int targetFD = open(currentCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        // If file can't be opened, print error and set exit status to 1
-        if (targetFD == -1) { 
-            printf("cannot open %s file for output\n", currentCommand->outputFile);
-            fflush(stdout);
-            exit(1); 
+/* Parses commands separated by ; and newlines up to the end of the tokens or a reserved word that ends the list */
+/* Returns the first node of the list, NULL if it is empty or there was an error (parse->failed or parse->incomplete) */
+/* Blank lines are skipped but a ; has to come after a command */
+struct commandNode* parseList(struct parser* parse){
+    struct commandNode* first = NULL;
+    struct commandNode** link = &first;
+    while (1){
+        skipSeparators(parse, 0);
+        if (parse->tokens[parse->position].type == TOKEN_END || atListEnd(parse)){
+            return first;
         }
-        
-        // Redirect stdout to target file
-        int result = dup2(targetFD, 1);
-        if (result == -1) { 
-            perror("target dup2()"); 
-            exit(2); 
+        if (parse->tokens[parse->position].type == TOKEN_SEPARATOR){
+            syntaxError(parse);
+            return NULL;
+        }
+        struct commandNode* node = parseAndOr(parse);
+        if (node == NULL){
+            return NULL;
+        }
+        *link = node;
+        link = &node->next;
+
+        // A block has to be followed by a separator too
+        int type = parse->tokens[parse->position].type;
+        if (type != TOKEN_SEPARATOR && type != TOKEN_NEWLINE && type != TOKEN_END && !atListEnd(parse)){
+            syntaxError(parse);
+            return NULL;
+        }
+        if (type == TOKEN_SEPARATOR){
+            parse->position++;
         }
     }
 }
 
-/* Handles redirecting input to dev/null/ for background commands */
-/* Referenced Exploration: Processes and I/O in course modules */
-void redirectItoDEV(struct userCommand* currentCommand){
+/* Parses a template's tokens into a program with nodes allocated from pool, returns NULL if it has no commands, */
+/* reports a syntax error or sets incomplete if a block or && or || isn't finished before the tokens run out */
+struct commandNode* parseTemplate(struct arena* pool, struct commandTemplate* template, int* incomplete){
+    struct parser parse = { pool, template->tokens, 0, 0, 0 };
+    struct commandNode* program = parseList(&parse);
+    if (!parse.failed && !parse.incomplete && parse.tokens[parse.position].type != TOKEN_END){
+        syntaxError(&parse); // A reserved word like fi or done with no block for it to end
+    }
+    *incomplete = parse.incomplete;
+    return (parse.failed || parse.incomplete) ? NULL : program;
+}
 
-    // Set input redirection to dev/null/
-    int sourceFD = open("/dev/null", O_RDONLY);
+/* Moves a cached line to the recently used end of the list */
+void touchCachedLine(struct cachedLine* entry){
+    if (entry == newestLine){
+        return;
+    }
+    // Unlink it, then put it in front
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    if (entry == oldestLine) oldestLine = entry->newer;
+    entry->newer = NULL;
+    entry->older = newestLine;
+    if (newestLine != NULL) newestLine->newer = entry;
+    newestLine = entry;
+    if (oldestLine == NULL) oldestLine = entry;
+}
 
-    // Redirect stdin to source file
-    int result = dup2(sourceFD, 0);
+/* Removes a line from the parsed command cache */
+void dropCachedLine(struct cachedLine* entry){
+    struct cachedLine** link = &parseCache[hashString(entry->line) % PARSE_CACHE_BUCKETS];
+    while (*link != entry){
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else newestLine = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else oldestLine = entry->newer;
+    arenaFree(&entry->pool);
+    free(entry);
+    parseCacheCount--;
 }
 
-/* Handles redirecting output to dev/null/ for background commands */
-/* Referenced Exploration: Processes and I/O in course modules */
-void redirectOtoDEV(struct userCommand* currentCommand){
+/* Parses a program read from the input (a line, or the lines of a block joined by newlines), through a cache of the */
+/* last PARSE_CACHE_LIMIT distinct programs, returns NULL if it has no commands or sets incomplete if it needs more lines */
+/* A program seen before skips tokenizing and parsing, its commands are only bound so expansions still see current values */
+struct commandNode* parseProgram(const char* line, int* incomplete){
+    unsigned int bucket = hashString(line) % PARSE_CACHE_BUCKETS;
+    struct cachedLine* entry;
+    *incomplete = 0;
+    for (entry = parseCache[bucket]; entry != NULL; entry = entry->next){
+        if (strcmp(entry->line, line) == 0){
+            parseCacheHits++;
+            touchCachedLine(entry);
+            return entry->program;
+        }
+    }
 
-    // Set output redirection to dev/null/
-    int targetFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    
-    // Redirect stdout to target file
-    int result = dup2(targetFD, 1);
+    // Not cached, parse a copy of the line that lives with the entry, evicting the least recently used line if full
+    // A block that isn't finished yet isn't kept, it comes back with more lines
+    parseCacheMisses++;
+    size_t length = strlen(line);
+    entry = calloc(1, sizeof(struct cachedLine));
+    entry->line = arenaStrndup(&entry->pool, line, length);
+    struct commandTemplate* template = buildTemplate(&entry->pool, arenaStrndup(&entry->pool, line, length));
+    entry->program = parseTemplate(&entry->pool, template, incomplete);
+    if (*incomplete){
+        arenaFree(&entry->pool);
+        free(entry);
+        return NULL;
+    }
+    if (parseCacheCount == PARSE_CACHE_LIMIT){
+        dropCachedLine(oldestLine);
+    }
+    entry->next = parseCache[bucket];
+    parseCache[bucket] = entry;
+    parseCacheCount++;
+    touchCachedLine(entry);
+    return entry->program;
 }
 
-/* Handles commands that are not builtins and running in the foreground */
-void handleExecCommand(struct userCommand* currentCommand){
-    // Creates a NULL terminated array of the arguments in the currentCommand struct to be used with execvp()
-    char* argv[513]; // To hold a copy of the arguments
-    argv[0] = currentCommand->command;
+/* Struct for an entry in the table of built in commands */
+struct builtin
+{
+    const char* name;
+    int (*run)(struct userCommand* currentCommand); // returns the exit status, or BUILTIN_FALLBACK to exec the command instead
+    int setsStatus; // Boolean, a stand in for an external command whose exit status is reported by status
+};
+
+/* Built in commands, sorted by name for bsearch */
+/* The ones that set the status stand in for external commands and only run in the shell in the foreground */
+const struct builtin builtinTable[] = {
+    {"[", builtinTest, 1},
+    {"acct", builtinAcct, 0},
+    {"break", builtinBreak, 0},
+    {"cache", builtinCache, 0},
+    {"cat", builtinCat, 1},
+    {"cd", builtinCD, 0},
+    {"continue", builtinContinue, 0},
+    {"cp", builtinCp, 1},
+    {"echo", builtinEcho, 1},
+    {"exit", builtinExit, 0},
+    {"export", builtinExport, 0},
+    {"false", builtinFalse, 1},
+    {"hash", builtinHash, 0},
+    {"history", builtinHistory, 0},
+    {"jobopt", builtinJobopt, 0},
+    {"jobs", builtinJobs, 0},
+    {"kill", builtinKill, 0},
+    {"parallel", builtinParallel, 0},
+    {"pipesize", builtinPipesize, 0},
+    {"printf", builtinPrintf, 1},
+    {"pwd", builtinPwd, 1},
+    {"status", builtinStatus, 0},
+    {"test", builtinTest, 1},
+    {"true", builtinTrue, 1},
+    {"unset", builtinUnset, 0},
+    {"wait", builtinWait, 0},
+};
+
+int compareBuiltin(const void* name, const void* entry){
+    return strcmp(name, ((const struct builtin*)entry)->name);
+}
+
+/* Returns the built in command called name, or NULL if it isn't one */
+const struct builtin* findBuiltin(const char* name){
+    return bsearch(name, builtinTable, sizeof(builtinTable) / sizeof(builtinTable[0]), sizeof(struct builtin), compareBuiltin);
+}
+
+/* Moves file onto targetFD for a built in running in the shell, returns a copy of the old targetFD to restore or -1 on error */
+int swapFD(const char* file, int flags, int targetFD){
+    int fileFD = open(file, flags | O_CLOEXEC, 0644);
+    if (fileFD == -1){
+        printf("cannot open %s file for %s\n", file, (targetFD == STDIN_FILENO) ? "input" : "output");
+        fflush(stdout);
+        return -1;
+    }
+    int savedFD = fcntl(targetFD, F_DUPFD_CLOEXEC, 10);
+    dup2(fileFD, targetFD);
+    close(fileFD);
+    return savedFD;
+}
+
+/* Runs a built in command inside the shell, < and > point stdin/stdout at the files just for the duration of the command */
+/* Returns the built in's result, or 1 if a redirection failed */
+int runBuiltin(const struct builtin* entry, struct userCommand* currentCommand){
+    int savedIn = -1, savedOut = -1;
+    int result = 1;
+    fflush(stdout);
+    if (currentCommand->inputFile != NULL && (savedIn = swapFD(currentCommand->inputFile, O_RDONLY, STDIN_FILENO)) == -1){
+        return 1;
+    }
+    if (currentCommand->outputFile == NULL || (savedOut = swapFD(currentCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO)) != -1){
+        result = entry->run(currentCommand);
+        fflush(stdout);
+    }
+
+    // Put the shell's own stdin and stdout back
+    if (savedOut != -1){
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+    if (savedIn != -1){
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    return result;
+}
+
+/* Runs a command (or pipeline) through exec, in the foreground or the background as the command and mode ask */
+/* Returns the foreground command's status, or 0 once a background command is launched or queued */
+int launchCommand(struct userCommand* currentCommand){
+    // If foreground only mode, only run commands in foreground
+    if (foregroundOnlyMode == 1 || currentCommand->toBackground == 0){
+        handleExecCommand(currentCommand);
+        return lastStatus();
+    }
+    pid_t backgroundPid = scheduleBackgroundCommand(currentCommand);
+    if (backgroundPid > 0){
+        printf("background pid is %d\n", backgroundPid); // Print message to user with background pid
+        fflush(stdout);
+    }
+    else if (backgroundPid == 0){
+        printf("background job queued (%d waiting)\n", queuedJobCount);
+        fflush(stdout);
+    }
+    return (backgroundPid == -1) ? 1 : 0;
+}
+
+/* Returns 1 if every word of a command is a NAME=value assignment */
+int assignmentsOnly(struct userCommand* currentCommand){
     int i;
-    for(i = 0; i < 512; i++){
-        if (currentCommand->argument[i] != NULL) {
-            argv[i+1] = currentCommand->argument[i];
-        }
-        else {
-            argv[i+1] = NULL;
-            break;
+    for (i = 0; currentCommand->argv[i] != NULL; i++){
+        if (!isAssignment(currentCommand->argv[i])){
+            return 0;
         }
     }
+    return 1;
+}
 
-    // Creates child process to handle the command
-    pid_t spawnpid = -5;
-    int childExitMethod = -5;
+/* Runs a parsed command, built in commands are looked up in builtinTable and everything else goes through exec */
+/* A command of nothing but NAME=value words only assigns the variables */
+/* Pipelines, timed commands and background commands always exec, except for the shell's own built ins that ignore &, */
+/* as do stand ins for external commands redirected to or from a named pipe, which the shell mustn't wait to open */
+/* Returns the command's exit status, for built ins that don't set the status too */
+int runCommand(struct userCommand* currentCommand){
+    const struct builtin* entry = NULL;
+    if (currentCommand->nextStage == NULL){
+        // A command made up only of NAME=value words sets those variables
+        int i;
+        if (assignmentsOnly(currentCommand)){
+            for (i = 0; currentCommand->argv[i] != NULL; i++){
+                assignVariable(currentCommand->argv[i]);
+            }
+            return 0;
+        }
+        entry = findBuiltin(currentCommand->command);
+    }
+    if (entry != NULL && entry->setsStatus && (currentCommand->timed || (currentCommand->toBackground == 1 && foregroundOnlyMode == 0) ||
+        isFIFO(currentCommand->inputFile) || isFIFO(currentCommand->outputFile))){
+        entry = NULL;
+    }
+    if (entry != NULL){
+        int result = runBuiltin(entry, currentCommand);
+        if (result != BUILTIN_FALLBACK){
+            if (entry->setsStatus){
+                statusExit = result;
+                exitTrue = 1;
+            }
+            return result;
+        }
+    }
+    return launchCommand(currentCommand);
+}
 
-    spawnpid = fork(); // THIS IS WHERE THE NEW PROCESS SPAWNS - child starts here and continues
-    switch (spawnpid)
-    {
-        // Something went wrong, fork returns -1 to parent process, sets global variable errno, no child process created
-        case -1:
-            statusExit = 1;
-            exitTrue = 1;
-            break;
-        // In child process fork() returns 0
-        case 0:
-            // Set SIGNIT action back to default (unlike the shell and background process which ignore it)
-            default_action.sa_handler = SIG_DFL;
-            sigaction(SIGINT, &default_action, NULL);
+int executeList(struct commandNode* node);
 
-            // Set SIGTSTP to be ignored by the child process
-            ignore_action.sa_handler = SIG_IGN;
-            sigaction(SIGTSTP, &ignore_action, NULL);
+/* Runs a loop's body once, returns 0 when the loop has to stop for break or ^C */
+/* Jobs that finished are reported between iterations as they are between lines, which is also when ^C is noticed */
+int runLoopBody(struct commandNode* node, int* status){
+    *status = executeList(node->body);
+    dispatchEvents(0);
+    if (interrupted){
+        loopControl = LOOP_INTERRUPT;
+    }
+    if (loopControl == LOOP_CONTINUE){
+        loopControl = 0;
+    }
+    else if (loopControl == LOOP_BREAK){
+        loopControl = 0;
+        return 0;
+    }
+    return loopControl == 0;
+}
 
-            // Check if process requires IO redirection- redirect IO if so
-            if (currentCommand->inputFile != NULL || currentCommand->outputFile != NULL){
-                redirectIO(currentCommand);
-                }
-            // If command could not be executed, print message to user and set value of status command to 1, otherwise execute
-            if (execvp(argv[0], argv) < 0){
-                printf("Command could not be executed...\n");
-                fflush(stdout);
-                statusExit = 1;
-                exitTrue = 1;
+/* Runs a node of a parsed program and returns its exit status, a command is bound from its template each time it runs */
+/* and goes through runCommand like a line of its own, everything bound is released from commandArena when the node */
+/* is done so a loop runs in the same memory on every iteration */
+int executeNode(struct commandNode* node){
+    int status = 0;
+    struct arenaMark mark = arenaPosition(&commandArena);
+    if (node->type == NODE_COMMAND){
+        struct userCommand* currentCommand = bindTemplate(&node->words);
+        if (currentCommand != NULL){
+            status = runCommand(currentCommand);
+        }
+        else if (bindFailed){
+            // A command that can't be run fails like any other, so && and if don't take it for success
+            statusExit = 2;
+            exitTrue = 1;
+            status = 2;
+        }
+    }
+    else if (node->type == NODE_AND || node->type == NODE_OR){
+        status = executeNode(node->condition);
+        if ((status == 0) == (node->type == NODE_AND) && loopControl == 0){
+            status = executeNode(node->body);
+        }
+    }
+    else if (node->type == NODE_IF){
+        int condition = executeList(node->condition);
+        if (loopControl == 0){
+            status = executeList((condition == 0) ? node->body : node->otherwise);
+        }
+    }
+    else if (node->type == NODE_WHILE){
+        loopDepth++;
+        while ((executeList(node->condition) == 0) != node->until && loopControl == 0 && runLoopBody(node, &status)){}
+        loopDepth--;
+    }
+    else if (node->type == NODE_FOR){
+        // The words are expanded when the loop starts, with globs and $(...) output split like a command's arguments
+        struct wordList list = {0};
+        int i;
+        for (i = 0; i < node->words.count; i++){
+            struct templateToken* token = &node->words.tokens[i];
+            int split = 0;
+            char* text = (token->text != NULL) ? token->text : bindWord(&commandArena, token->segments, &split);
+            if (split){
+                splitWord(&list, text);
             }
-            break;
-        // In parent process fork() returns process id of the child process that was just created
-        default:
-            processes[numberOfProcesses] = spawnpid; // Put pid of child process into array of processes, then increment for next pid
-            numberOfProcesses++;
-            waitpid(spawnpid, &childExitMethod, 0); // waits for the child process to terminate
-
-            // If terminated normally, set global status to the exit status
-            if (WIFEXITED(childExitMethod)){
-                int exitStatus = WEXITSTATUS(childExitMethod);
-                statusExit = exitStatus;
-                exitTrue = 1;
+            else {
+                expandWord(&list, text);
             }
-            // If terminated by signal, set global status to the terminating signal
-            else if (WIFSIGNALED(childExitMethod)) {
-                int termSignal = WTERMSIG(childExitMethod);
-                statusSignal = termSignal;
-                exitTrue = 0;
+        }
+        size_t nameLength = strlen(node->variable);
+        loopDepth++;
+        for (i = 0; i < list.count; i++){
+            setVariable(node->variable, nameLength, list.words[i], strlen(list.words[i]));
+            if (!runLoopBody(node, &status)){
+                break;
             }
-            break;
+        }
+        loopDepth--;
     }
+    arenaRelease(&commandArena, mark);
+    return node->negate ? !status : status;
 }
 
-/* Handles commands that are not builtins and running in the background, returns a pointer to struct of info for that background process including id and exitmethod */
-struct bgProcessInfo *handleBackgroundCommand(struct userCommand* currentCommand){
-    // Creates a NULL terminated array of the arguments in the currentCommand struct to be used with execvp()
-    char* argv[513]; // To hold a copy of the arguments
-    argv[0] = currentCommand->command;
-    int i;
-    for(i = 0; i < 512; i++){
-        if (currentCommand->argument[i] != NULL) {
-            argv[i+1] = currentCommand->argument[i];
+/* Runs a list of nodes one after another, returns the status of the last one, or 0 for an empty list */
+/* The list is cut short by break, continue or ^C */
+int executeList(struct commandNode* node){
+    int status = 0;
+    for (; node != NULL && loopControl == 0; node = node->next){
+        status = executeNode(node);
+    }
+    return status;
+}
+
+/* Reads fd until end of file into a malloc'd buffer that doubles as it fills, returns it and sets length */
+char* readAll(int fd, size_t* length){
+    size_t capacity = 4096, used = 0;
+    char* buffer = malloc(capacity);
+    while (1){
+        if (used == capacity){
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
         }
-        else {
-            argv[i+1] = NULL;
+        ssize_t bytesRead = read(fd, buffer + used, capacity - used);
+        if (bytesRead == -1 && errno == EINTR){
+            continue;
+        }
+        if (bytesRead <= 0){
             break;
         }
+        used += bytesRead;
     }
+    *length = used;
+    return buffer;
+}
 
-    // Creates child process to handle the command
-    pid_t spawnpid = -5;
-    int childExitMethod = -5;
+/* Runs the command line for a $(...) substitution and returns what it wrote to stdout, malloc'd and without trailing */
+/* newlines, the shell's status is set from the command like any other foreground command */
+/* Built ins that stand in for external commands run in the shell with their output captured in a memfd, other built ins */
+/* and assignments run in a forked copy of the shell so they can't change it, everything else is launched with its */
+/* output going to a pipe that is read until the command closes it */
+/* Several commands or a block run in a forked copy of the shell too, it is accounted as a command named by the text */
+char* captureOutput(char* commandLine, size_t* length){
+    char* output = NULL;
+    *length = 0;
+    struct userCommand block = {0};
+    char* blockArgv[2] = { arenaStrndup(&commandArena, commandLine, strlen(commandLine)), NULL };
+    int incomplete;
+    struct commandNode* program = parseTemplate(&commandArena, buildTemplate(&commandArena, commandLine), &incomplete);
+    if (incomplete){
+        printf("syntax error near end of $(%s)\n", blockArgv[0]);
+        fflush(stdout);
+    }
+    if (program == NULL){
+        return NULL;
+    }
+    struct userCommand* currentCommand;
+    if (program->type == NODE_COMMAND && !program->negate && program->next == NULL){
+        currentCommand = bindTemplate(&program->words);
+        if (currentCommand == NULL){
+            return NULL;
+        }
+        program = NULL;
+    }
+    else {
+        block.argv = blockArgv;
+        block.command = blockArgv[0];
+        block.argument = blockArgv + 1;
+        currentCommand = &block;
+    }
+    const struct builtin* entry = (program == NULL && currentCommand->nextStage == NULL) ? findBuiltin(currentCommand->command) : NULL;
 
-    spawnpid = fork(); // THIS IS WHERE THE NEW PROCESS SPAWNS - child starts here and continues
-    switch (spawnpid)
-    {
-        // Something went wrong, fork returns -1 to parent process, sets global variable errno, no child process created
-        case -1:
-            statusExit = 1;
-            exitTrue = 1;
-            break;
-        // In child process fork() returns 0
-        case 0:
-            // Check if process requires IO redirection- redirect IO if so
-            if (currentCommand->inputFile != NULL || currentCommand->outputFile != NULL){
-                redirectIO(currentCommand);
-            }
-            // If user doesn't redirect standard input, then standard input redirected to /dev/null
-            if (currentCommand->inputFile == NULL){
-                redirectItoDEV(currentCommand);
-            }
-            // If user doesn't redirect standard output, then standard input redirected to /dev/null
-            if (currentCommand->outputFile == NULL){
-                redirectOtoDEV(currentCommand);
+    if (entry != NULL && entry->setsStatus && !currentCommand->timed){
+        if (captureFD == -1){
+            captureFD = memfd_create("smallsh-capture", MFD_CLOEXEC);
+        }
+        if (captureFD != -1){
+            ftruncate(captureFD, 0);
+            lseek(captureFD, 0, SEEK_SET);
+            fflush(stdout);
+            int savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(captureFD, STDOUT_FILENO);
+            int result = runBuiltin(entry, currentCommand);
+            dup2(savedOut, STDOUT_FILENO);
+            close(savedOut);
+            if (result != BUILTIN_FALLBACK){
+                statusExit = result;
+                exitTrue = 1;
+                lseek(captureFD, 0, SEEK_SET);
+                output = readAll(captureFD, length);
             }
+        }
+    }
 
-            // Set SIG_INT to be ignored by the background process
-            ignore_action.sa_handler = SIG_IGN;
-            sigaction(SIGINT, &ignore_action, NULL);
-
-            // Set SIGTSTP to be ignored by the background process
-            ignore_action.sa_handler = SIG_IGN;
-            sigaction(SIGTSTP, &ignore_action, NULL);
-
-            // If command could not be executed, print message to user and set value of status command to 1, otherwise execute 
-            if (execvp(argv[0], argv) < 0){
-                printf("Command could not be executed...\n");
+    if (output == NULL){
+        int pipeEnds[2];
+        if (pipe2(pipeEnds, O_CLOEXEC) == -1){
+            perror("pipe2()");
+            return NULL;
+        }
+        int stages = countStages(currentCommand);
+        pid_t* stagePids = arenaAlloc(&commandArena, stages * sizeof(pid_t));
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if (program != NULL || (entry != NULL && !entry->setsStatus) || (currentCommand->nextStage == NULL && assignmentsOnly(currentCommand))){
+            // The copy of the shell doesn't own the background jobs, exit mustn't kill them
+            fflush(stdout);
+            stagePids[0] = fork();
+            if (stagePids[0] == 0){
+                dup2(pipeEnds[1], STDOUT_FILENO);
+                forgetJobs();
+                int status = (program != NULL) ? executeList(program) : runCommand(currentCommand);
                 fflush(stdout);
-                statusExit = 1;
-                exitTrue = 1;
+                _exit(status);
             }
-            break;
-        // In parent process fork() returns process id of the child process that was just created
-        default:
-            processes[numberOfProcesses] = spawnpid; // Put pid of child process into array of processes, then increment for next pid
-            numberOfProcesses++;
+        }
+        else {
+            launchPipeline(currentCommand, 0, stagePids, pipeEnds[1]);
+        }
+        close(pipeEnds[1]);
+        output = readAll(pipeEnds[0], length);
+        close(pipeEnds[0]);
+        waitForeground(currentCommand, stagePids, stages, &started);
+    }
 
-            // Create struct with child process info (ID and exitMethod) for use in main shell function, return that struct
-            struct bgProcessInfo *info  = malloc(sizeof(struct bgProcessInfo));
-            info->childID = spawnpid;
-            info->childExitMethod = childExitMethod;
-            return info;
+    while (*length > 0 && output[*length - 1] == '\n'){
+        (*length)--;
     }
+    return output;
 }
 
-/* Parse the command given by user into the command struct, returns pointer to that struct*/
-struct userCommand *createCommand(char *userInput)
-{
-    userInput[strlen(userInput)-1] = '\0'; // Remove newline character from userInput
-    struct userCommand *currCommand = malloc(sizeof(struct userCommand));
-
-    currCommand->toBackground = 0; // Set toBackground value to False as default behavior
-
-    char expansionBuffer[10]; // For use with strreplace function
-    snprintf(expansionBuffer, 10, "%d", pid);
-    char tmp_token[200]; // To store value in token and copy it over after varaible expansion
-
-    // For use with strtok_r
-    char *saveptr;
-    char *end;
-
-    // Get command data and put it into struct attribute, replacing $$ with the PID
-    char *token = strtok_r(userInput, " ", &saveptr);
-    strcpy(tmp_token, token);
-    replaceSubstring(tmp_token, "$$", expansionBuffer);
-    currCommand->command = calloc(strlen(tmp_token) + 1, sizeof(char));
-    strcpy(currCommand->command, tmp_token);
-    memset(tmp_token, '\0', sizeof(tmp_token));
-
-    // Get arguments data and put them into struct attribute
-    int arg_count = 0;
-    while (1) {
-        token = strtok_r(NULL, " ", &saveptr);
-        if (token == NULL){
+/* Reads the lines that finish a block begun on line, prompting with "> " at a terminal, and returns the program they */
+/* make up, or NULL if the input runs out first. The lines are joined by newlines so the block is cached as one program */
+struct commandNode* readBlock(struct inputReader* reader, const char* line){
+    size_t blockLength = strlen(line);
+    char* block = malloc(blockLength + 1);
+    memcpy(block, line, blockLength + 1);
+    struct commandNode* program = NULL;
+    int incomplete = 1;
+    prompt = "> ";
+    while (incomplete){
+        if (interactive){
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+        char* nextLine = waitForLine(reader);
+        if (nextLine == NULL){
+            printf("syntax error near end of file\n");
+            fflush(stdout);
             break;
         }
-        else if (token[0] == '<' || token[0] == '>'){ // Check for input/output redirects
-            if (token[0] == '<'){ // Input redirection- get filename for input and put it into struct attribute
-                token = strtok_r(NULL, " ", &saveptr);
-                currCommand->inputFile = calloc(strlen(token) + 1, sizeof(char));
-                strcpy(currCommand->inputFile, token);
-            }
-            else if (token[0] == '>'){ // Output redirection- get filename for output and put it into struct attribute
-                token = strtok_r(NULL, " ", &saveptr);
-                currCommand->outputFile = calloc(strlen(token) + 1, sizeof(char));
-                strcpy(currCommand->outputFile, token);
-            }
+        if (nextLine[0] == '#'){
+            continue;
         }
-        else if (token[0] == '&'){
-            // Check to make sure there are no more arguments given by calling for next token
-            token = strtok_r(NULL, " ", &saveptr);
-            if (token == NULL){ // If there are no more arguments given then this means last argument so command is to be executed in background
-                currCommand->toBackground = 1;
+        if (interactive){
+            nextLine = expandHistory(nextLine);
+            if (nextLine == NULL){
+                break;
             }
+            addHistory(nextLine);
         }
-        else {
-            strcpy(tmp_token, token);
-            replaceSubstring(tmp_token, "$$", expansionBuffer); // Replace $$ with PID
-            currCommand->argument[arg_count] = calloc(strlen(tmp_token) + 1, sizeof(char));
-            strcpy(currCommand->argument[arg_count], tmp_token);
-            memset(tmp_token, '\0', sizeof(tmp_token));
-        }
-        arg_count++;
+        size_t lineLength = strlen(nextLine);
+        block = realloc(block, blockLength + lineLength + 2);
+        block[blockLength++] = '\n';
+        memcpy(block + blockLength, nextLine, lineLength + 1);
+        blockLength += lineLength;
+        program = parseProgram(block, &incomplete);
     }
-    // Print statement for debugging- prints all input given to as a command
-    // printf("COMMAND: %s, ARGS: %s, INPUT: %s, OUTPUT %s, BG: %d\n", currCommand->command, currCommand->argument[0], currCommand->inputFile, currCommand->outputFile, currCommand->toBackground);
-    // fflush(stdout);
-    return currCommand;
+    prompt = ": ";
+    free(block);
+    return program;
 }
 
-
-int main(){
-    int backgroundProcessRunning = 0; // Boolean variable, default no background process running
+/* Runs commands from the file named as the first argument, or from stdin, prompting only when stdin is a terminal */
+int main(int argc, char* argv[]){
     foregroundOnlyMode = 0; // Boolean variable, default is not in foreground only mode
-    numberOfProcesses = 0; // Set number of processes to zero before any commands run
+    freeJobSlot = -1; // Job table starts out empty, it is allocated when the first background job launches
     exitTrue = 1; // Set exit status boolean to False before any commands run
     statusExit = 0; // Set global variable to 0 before any commands run
     pid = getpid(); // Set global variable pid to process ID of smallsh
-    struct bgProcessInfo *bgCommandInfo;
-    char commandInput[2050]; // Maximum length of command is 2048 characters and it receives new line char as well
-    
-    // Set SIG_INT to be ignored by the shell
-    ignore_action.sa_handler = SIG_IGN;
-    sigaction(SIGINT, &ignore_action, NULL);
+    pidLength = snprintf(pidString, sizeof(pidString), "%d", pid); // Text $$ expands to, formatted once
+    importEnvironment(); // Shell variables start out as the environment, all exported
+    char* commandInput; // Line of input currently being run, any length
+    struct inputReader input = {0};
+    input.fd = STDIN_FILENO;
+    input.capacity = INPUT_BUFFER_SIZE;
+    input.buffer = malloc(input.capacity);
 
-    // Set SIG_TSTP to call handler defined above, and set the shell to 'foreground only' state where it ignores '&' in commands
-    SIGTSTP_action.sa_handler = handle_SIGTSTP;
-    sigfillset(&SIGTSTP_action.sa_mask);
-	SIGTSTP_action.sa_flags = SA_RESTART;
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    // Given a script file, read commands from it instead of stdin, otherwise only prompt if stdin is a terminal
+    if (argc > 1){
+        input.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (input.fd == -1){
+            printf("cannot open %s\n", argv[1]);
+            fflush(stdout);
+            exit(1);
+        }
+        interactive = 0;
+    }
+    else {
+        interactive = isatty(STDIN_FILENO);
+    }
+    
+    // Signals and background job completions are handled from an event loop rather than signal handlers
+    setupEventLoop(input.fd);
+    if (interactive){
+        openHistory(); // Scripts neither keep nor use history
+    }
 
-    // Main loop for shell prompt, continues prompting until user enters 'exit'
+    // Main loop for shell prompt, continues prompting until user enters 'exit' or input runs out
     while (1 == 1){
 
-        // Check if background process has terminated- print message with the ended processes id and exit status if so
-        int childExitMethod = -5;
-        if (backgroundProcessRunning == 1){
-            if(waitpid(bgCommandInfo->childID, &childExitMethod, WNOHANG) != 0) {
+        // Handle anything that happened while the last command ran- background processes that terminated are reported
+        // with their id and exit status, and a ^Z pressed meanwhile switches foreground only mode now
+        dispatchEvents(0);
 
-            // If background process terminated normally, print out that status to terminal
-            if (WIFEXITED(childExitMethod)){
-                int exitStatus = WEXITSTATUS(childExitMethod);
-                printf("background pid %d is done: exit value %d\n", bgCommandInfo->childID, exitStatus);
-                fflush(stdout);
-            }
-            // If background process terminated by signal, print that status to terminal
-            else if (WIFSIGNALED(childExitMethod)) {
-                int termSignal = WTERMSIG(childExitMethod);
-                printf("background pid %d is done: terminated by signal %d\n", bgCommandInfo->childID, termSignal);
-                fflush(stdout);
-            }
-                // Reset backgroundProcessRunning boolean variable to 0 as process has terminated
-                backgroundProcessRunning = 0;
+        // After checking for background processes, display shell prompt (scripts run without one)
+        if (interactive){
+            printf(": ");
+            fflush(stdout);
+        }
+        commandInput = waitForLine(&input);
+
+        // End of input- leave like exit would, but in script mode background jobs are left to finish on their own,
+        // unless commands are still queued under the parallel -j cap, then the shell stays until every job is done
+        if (commandInput == NULL){
+            if (interactive){
+                printf("\n");
+                builtinExit(NULL);
             }
+            interrupted = 0;
+            while (jobQueueHead != NULL && !waitAllJobs()){}
+            exit(lastStatus());
         }
 
-        // After checking for background processes, display shell prompt
-        printf(": ");
-        fflush(stdout);
-        fgets(commandInput, 2050, stdin);
-        if (commandInput[0] == '\n') {} // If given no input, do nothing
+        if (commandInput[0] == '\0') {} // If given no input, do nothing
         else if (strncmp(commandInput, "#" , 1) == 0){} // If line begins with #, it is a comment line
         else {
-            struct userCommand *currentCommand = createCommand(commandInput);    // User gives input, pass it to createCommand to parse the command and arguments, create pointer to struct
-            // Handles built in command "cd"
-            if (strcmp(currentCommand->command, "cd") == 0){
-                builtinCD(currentCommand);
-            }
-            // Handles built in command "status"
-            else if (strcmp(currentCommand->command, "status") == 0){
-                builtinStatus();
-            }
-            // Handles built in command "exit"
-            else if (strcmp(currentCommand->command, "exit") == 0){ 
-                builtinExit();
-            }
-            // Handles commands through exec
-            else{
-                // If foreground only mode, only run commands in foreground
-                if (foregroundOnlyMode == 1){
-                    handleExecCommand(currentCommand);
-                }
-                // If not in foreground only mode, check if command is to be run in the background
-                else{
-                    // Checks if command is supposed to be run in background, passes to appropriate function to execute
-                    if (currentCommand->toBackground == 0){
-                        handleExecCommand(currentCommand);
-                    }
-                    else if (currentCommand->toBackground == 1){
-                        bgCommandInfo = handleBackgroundCommand(currentCommand);
-                        printf("background pid is %d\n", bgCommandInfo->childID); // Print message to user with background pid
-                        fflush(stdout);
-                        backgroundProcessRunning = 1; // Set backgroundProcessRunning to true to trigger conditional before next shell prompt
-                    }
+            // At a terminal, ! events are replaced from the history and the line is added to it
+            if (interactive){
+                commandInput = expandHistory(commandInput);
+                if (commandInput != NULL){
+                    addHistory(commandInput);
                 }
             }
+            // User gives input, pass it to parseProgram to parse the commands on it, a block that doesn't end on this line
+            // is read up to its end first
+            int incomplete = 0;
+            struct commandNode* program = (commandInput == NULL) ? NULL : parseProgram(commandInput, &incomplete);
+            if (incomplete){
+                program = readBlock(&input, commandInput);
+            }
+            // Line held nothing but spaces, do nothing
+            interrupted = 0;
+            executeList(program);
+            loopControl = 0;
+            arenaReset(&commandArena); // Free the parsed commands and everything they point to in one step
         }
-        memset(commandInput, '\0', sizeof(commandInput)); // Reset commandInput back to nothing
     }
 }
\ No newline at end of file